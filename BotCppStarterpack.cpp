@@ -1,5 +1,6 @@
 #include <iostream>
 #include "game.h"
+#include "botplugin.h"
 
 #ifdef GAMEDEBUG
 #include <SDL.h>
@@ -19,7 +20,7 @@
 // http://www.ai-contest.com/resources.
 void DoTurn(const Game& pw) {
 	// (1) If we currently have a fleet in flight, just do nothing.
-	if (pw.MyFleets().size() >= 1) {
+	if (!pw.ViewFleets(OwnerMe).empty()) {
 		return;
 	}
 #ifdef GAMEDEBUG
@@ -29,9 +30,9 @@ void DoTurn(const Game& pw) {
 	int source = -1;
 	double source_score = -999999.0;
 	int source_num_ships = 0;
-	std::vector<Planet> my_planets = pw.MyPlanets();
-	for (size_t i = 0; i < my_planets.size(); ++i) {
-		const Planet& p = my_planets[i];
+	const PlanetView my_planets = pw.ViewPlanets(OwnerMe);
+	for (PlanetView::iterator i = my_planets.begin(); i != my_planets.end(); ++i) {
+		const Planet p = *i;
 		double score = (double)p.numShips;
 #ifdef GAMEDEBUG
 		debugInfo->planetColor[p.planetId] = Color(0,150,0) * CLAMP(2.0f - 5.0f / (float(score) + 1.0f), 0.5f, 1.5f);
@@ -45,9 +46,9 @@ void DoTurn(const Game& pw) {
 	// (3) Find the weakest enemy or neutral planet.
 	int dest = -1;
 	double dest_score = -999999.0;
-	std::vector<Planet> not_my_planets = pw.NotMyPlanets();
-	for (size_t i = 0; i < not_my_planets.size(); ++i) {
-		const Planet& p = not_my_planets[i];
+	const PlanetView not_my_planets = pw.ViewPlanets(OwnerNotMe);
+	for (PlanetView::iterator i = not_my_planets.begin(); i != not_my_planets.end(); ++i) {
+		const Planet p = *i;
 		double score = 1.0 / (1 + p.numShips);
 #ifdef GAMEDEBUG
 		debugInfo->planetInfo[p.planetId] = "score: " + to_string(score);
@@ -68,18 +69,30 @@ void DoTurn(const Game& pw) {
 #endif
 }
 
+#ifdef PW_BOT_PLUGIN
+PW_BOT_PLUGIN_EXPORT(DoTurn)
+#else
+
+// Set by the argument -shm: talk to the engine over shared memory if it
+// offers that. Off by default: with deltas, the turns are small, and for
+// those it is not faster than the pipes (see benchgame shm).
+static bool requestSharedMemory = false;
+
 int PlayGame(void* p = NULL) {
 	bool isFirstTurn = true;
 	std::string current_line;
 	std::string map_data;
+	Game game; // reused, so parsing doesn't reallocate every turn
 	while (true) {
 		int c = std::cin.get();
 		if(c < 0) break;
 		current_line += (char)(unsigned char)c;
 		if (c == '\n') {
 			if (current_line.length() >= 2 && current_line.substr(0, 2) == "go") {
-				Game game;
-				game.ParseGameState(map_data);
+				if (Game::IsDelta(map_data))
+					game.ApplyDelta(map_data);
+				else
+					game.ParseGameState(map_data);
 #ifdef GAMEDEBUG
 				if(isFirstTurn)
 					Viewer_pushInitialGame(new Game(game));
@@ -88,8 +101,21 @@ int PlayGame(void* p = NULL) {
 #endif
 				map_data = "";
 				DoTurn(game);
+				if (isFirstTurn) {
+					game.RequestDelta();
+					game.RequestMultiGame();
+					game.RequestClock();
+					if (requestSharedMemory) game.RequestSharedMemory();
+				}
 				game.FinishTurn();
 				isFirstTurn = false;
+			} else if (current_line == "end\n") {
+				// The game is over and the next one starts.
+				game.clear();
+				map_data = "";
+				isFirstTurn = true;
+			} else if (game.ParseClock(current_line)) {
+				// game.turnTimeLimit etc. are set now.
 			} else {
 				map_data += current_line;
 			}
@@ -102,6 +128,8 @@ int PlayGame(void* p = NULL) {
 // This is just the main game loop that takes care of communicating with the
 // game engine for you. You don't have to understand or change the code below.
 int main(int argc, char *argv[]) {
+	for (int i = 1; i < argc; ++i)
+		if (std::string(argv[i]) == "-shm") requestSharedMemory = true;
 #ifdef GAMEDEBUG
 	if(!Viewer_initWindow("My Bot")) return 1;
 	
@@ -117,3 +145,5 @@ int main(int argc, char *argv[]) {
 #endif
 	return 0;
 }
+
+#endif
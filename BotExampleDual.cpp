@@ -1,5 +1,6 @@
 #include <iostream>
 #include "game.h"
+#include "botplugin.h"
 
 static void DoTurn(const Game& pw) {
 	unsigned int numFleets = 1;
@@ -20,7 +21,7 @@ static void DoTurn(const Game& pw) {
 	}
 	// (1) If we current have more tha numFleets fleets in flight, just do
 	// nothing until at least one of the fleets arrives.
-	if (pw.MyFleets().size() >= numFleets) {
+	if (pw.ViewFleets(OwnerMe).size() >= numFleets) {
 	    return;
 	}
 	// (2) Find my strongest planet.
@@ -37,11 +38,8 @@ static void DoTurn(const Game& pw) {
 	// (3) Find the weakest enemy or neutral planet.
 	int dest = -1;
 	double destScore = -1;
-	std::vector<Planet> candidates = pw.NotMyPlanets();
-	if (attackMode) {
-	    candidates = pw.EnemyPlanets();
-	}
-	for (std::vector<Planet>::iterator p = candidates.begin(); p != candidates.end(); ++p) {
+	const PlanetView candidates = pw.ViewPlanets(attackMode ? OwnerEnemy : OwnerNotMe);
+	for (PlanetView::iterator p = candidates.begin(); p != candidates.end(); ++p) {
 	    double score = (double)(1 + p->growthRate) / p->numShips;
 	    if (score > destScore) {
 			destScore = score;
@@ -57,20 +55,31 @@ static void DoTurn(const Game& pw) {
 }
 
 
+#ifdef PW_BOT_PLUGIN
+PW_BOT_PLUGIN_EXPORT(DoTurn)
+#else
+
 int main(int argc, char *argv[]) {
 	std::string current_line;
 	std::string map_data;
+	bool isFirstTurn = true;
+	Game game; // reused, so parsing doesn't reallocate every turn
 	while (true) {
 		int c = std::cin.get();
 		if(c < 0) break;
 		current_line += (char)(unsigned char)c;
 		if (c == '\n') {
 			if (current_line.length() >= 2 && current_line.substr(0, 2) == "go") {
-				Game game;
-				game.ParseGameState(map_data);
+				if (Game::IsDelta(map_data))
+					game.ApplyDelta(map_data);
+				else
+					game.ParseGameState(map_data);
 				map_data = "";
 				DoTurn(game);
+				if (isFirstTurn)
+					game.RequestDelta();
 				game.FinishTurn();
+				isFirstTurn = false;
 			} else {
 				map_data += current_line;
 			}
@@ -79,3 +88,5 @@ int main(int argc, char *argv[]) {
 	}
 	return 0;
 }
+
+#endif
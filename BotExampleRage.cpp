@@ -1,10 +1,11 @@
 #include <iostream>
 #include "game.h"
+#include "botplugin.h"
 
 static void DoTurn(const Game& pw) {
-	typedef std::vector<Planet> Planets;
-	Planets myPlanets = pw.MyPlanets();
-	Planets enemyPlanets = pw.EnemyPlanets();
+	typedef PlanetView Planets;
+	const Planets myPlanets = pw.ViewPlanets(OwnerMe);
+	const Planets enemyPlanets = pw.ViewPlanets(OwnerEnemy);
 	for (Planets::iterator source = myPlanets.begin(); source != myPlanets.end(); ++source) {
 	    if (source->numShips < 10 * source->growthRate) {
 			continue;
@@ -25,20 +26,31 @@ static void DoTurn(const Game& pw) {
 }
 
 
+#ifdef PW_BOT_PLUGIN
+PW_BOT_PLUGIN_EXPORT(DoTurn)
+#else
+
 int main(int argc, char *argv[]) {
 	std::string current_line;
 	std::string map_data;
+	bool isFirstTurn = true;
+	Game game; // reused, so parsing doesn't reallocate every turn
 	while (true) {
 		int c = std::cin.get();
 		if(c < 0) break;
 		current_line += (char)(unsigned char)c;
 		if (c == '\n') {
 			if (current_line.length() >= 2 && current_line.substr(0, 2) == "go") {
-				Game game;
-				game.ParseGameState(map_data);
+				if (Game::IsDelta(map_data))
+					game.ApplyDelta(map_data);
+				else
+					game.ParseGameState(map_data);
 				map_data = "";
 				DoTurn(game);
+				if (isFirstTurn)
+					game.RequestDelta();
 				game.FinishTurn();
+				isFirstTurn = false;
 			} else {
 				map_data += current_line;
 			}
@@ -47,3 +59,5 @@ int main(int argc, char *argv[]) {
 	}
 	return 0;
 }
+
+#endif
@@ -2,6 +2,7 @@
 #include <cstdlib>
 #include "utils.h"
 #include "game.h"
+#include "botplugin.h"
 
 static double NextRandD() {
 	return double(rand()) / RAND_MAX;
@@ -12,23 +13,22 @@ static size_t NextRand(size_t upperLimit) { // limit excluded
 }
 
 static void DoTurn(const Game& pw) {
-	typedef std::vector<Planet> Planets;
 	// (1) If we current have a fleet in flight, then do nothing until it
 	// arrives.
-	if (pw.MyFleets().size() >= 1) {
+	if (!pw.ViewFleets(OwnerMe).empty()) {
 	    return;
 	}
 	// (2) Pick one of my planets at random.
 	int source = -1;
-	Planets p = pw.MyPlanets();
-	if (p.size() > 0) {
-	    source = NextRand(p.size());
+	size_t numPlanets = pw.ViewPlanets(OwnerMe).size();
+	if (numPlanets > 0) {
+	    source = NextRand(numPlanets);
 	}
 	// (3) Pick a target planet at random.
 	int dest = -1;
-	p = pw.Planets();
-	if (p.size() > 0) {
-	    dest = NextRand(p.size());
+	numPlanets = pw.NumPlanets();
+	if (numPlanets > 0) {
+	    dest = NextRand(numPlanets);
 	}
 	// (4) Send half the ships from source to dest.
 	if (source >= 0 && dest >= 0 && source != dest) {
@@ -37,21 +37,32 @@ static void DoTurn(const Game& pw) {
 	}
 }
 
+#ifdef PW_BOT_PLUGIN
+PW_BOT_PLUGIN_EXPORT(DoTurn)
+#else
+
 int main(int argc, char *argv[]) {
 	srand(currentTimeMillis());
 	std::string current_line;
 	std::string map_data;
+	bool isFirstTurn = true;
+	Game game; // reused, so parsing doesn't reallocate every turn
 	while (true) {
 		int c = std::cin.get();
 		if(c < 0) break;
 		current_line += (char)(unsigned char)c;
 		if (c == '\n') {
 			if (current_line.length() >= 2 && current_line.substr(0, 2) == "go") {
-				Game game;
-				game.ParseGameState(map_data);
+				if (Game::IsDelta(map_data))
+					game.ApplyDelta(map_data);
+				else
+					game.ParseGameState(map_data);
 				map_data = "";
 				DoTurn(game);
+				if (isFirstTurn)
+					game.RequestDelta();
 				game.FinishTurn();
+				isFirstTurn = false;
 			} else {
 				map_data += current_line;
 			}
@@ -60,3 +71,5 @@ int main(int argc, char *argv[]) {
 	}
 	return 0;
 }
+
+#endif
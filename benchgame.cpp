@@ -0,0 +1,410 @@
+/*
+ *  benchgame.cpp
+ *  PlanetWars
+ *
+ *  code under GPLv3
+ *
+ */
+
+// Benchmarks, see "make bench". Without arguments, it runs all of them:
+//   search : depth-first search with copied states vs. GameStateUndo
+//   views : the starter bot's loops over PlanetView / FleetView vs. the
+//     vector-returning accessors
+//   parse : ParseGameState with 10 to 10000 planets vs. the old parser
+//   pipe : a million order lines from a process through Process::readLine
+//   plugin : a game of two bot processes vs. the same bots as plugins
+//   shm : the time of an empty turn over pipes vs. shared memory
+// "benchgame <name>" runs only that one. The bots and plugins have to be
+// built for the last two.
+// The bench process also plays the other side: "benchgame lines <n>" prints
+// n order lines and "benchgame idlebot" is a bot which only says go.
+
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/time.h>
+#include <unistd.h>
+#include "game.h"
+#include "engine.h"
+#include "process.h"
+#include "utils.h"
+
+using namespace std;
+
+static string progName;
+
+static long long NowMicros() {
+	timeval t;
+	gettimeofday(&t, NULL);
+	return (long long)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+struct Random {
+	unsigned long long x;
+	Random(unsigned long long seed) : x(seed * 0x9E3779B97F4A7C15ULL + 1) {}
+	int Next(int n) {
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		return (int)((x >> 33) % (unsigned long long)n);
+	}
+};
+
+// A point-symmetric map like the stock ones: neutral planets in pairs, the
+// home planets of both players and numFleets fleets in flight.
+static string RandomMap(Random& r, int numPlanets, int numFleets) {
+	ostringstream s;
+	s << "P 11.5 11.5 0 " << r.Next(100) << " " << r.Next(6) << "\n";
+	s << "P 2.25 3.5 1 100 5\nP 20.75 19.5 2 100 5\n";
+	for (int p = 3; p + 1 < numPlanets; p += 2) {
+		const double x = r.Next(2300) / 100.0, y = r.Next(2300) / 100.0;
+		const int ships = r.Next(100), growth = r.Next(6);
+		s << "P " << x << " " << y << " 0 " << ships << " " << growth << "\n";
+		s << "P " << 23 - x << " " << 23 - y << " 0 " << ships << " " << growth << "\n";
+	}
+	for (int f = 0; f < numFleets; ++f) {
+		const int total = 1 + r.Next(20);
+		s << "F " << 1 + r.Next(2) << " " << 1 + r.Next(50) << " " << r.Next(numPlanets) << " "
+		<< r.Next(numPlanets) << " " << total << " " << 1 + r.Next(total) << "\n";
+	}
+	return s.str();
+}
+
+static string WriteTempMap(const string& map) {
+	char filename[] = "/tmp/benchgame-map-XXXXXX";
+	const int fd = mkstemp(filename);
+	if (fd < 0) return "";
+	close(fd);
+	ofstream(filename) << map;
+	return filename;
+}
+
+// ---------------- search ----------------
+// Player 1 has Branching choices in every turn: nothing, or half of the
+// ships of its biggest planet to one of some planets. Player 2 waits.
+
+static const int Branching = 3;
+
+static void MoveOrders(const GameDesc& desc, const GameState& state, int move, vector<Order>& orders) {
+	orders.clear();
+	if (move == 0) return;
+	int source = -1;
+	for (size_t p = 0; p < state.planets.size(); ++p)
+		if (state.planets[p].owner == 1 && (source < 0 || state.planets[p].numShips > state.planets[source].numShips))
+			source = (int)p;
+	if (source < 0 || state.planets[source].numShips < 2) return;
+	const int dest = (source + move * 5) % (int)state.planets.size();
+	if (dest != source) orders.push_back(Order(source, dest, state.planets[source].numShips / 2));
+}
+
+static int Evaluate(const GameState& state) {
+	return state.NumShips(1) - state.NumShips(2);
+}
+
+static int SearchCopy(const GameDesc& desc, const GameState& state, int depth, vector<Order>& orders) {
+	if (depth == 0) return Evaluate(state);
+	int best = INT_MIN;
+	for (int m = 0; m < Branching; ++m) {
+		GameState child(state);
+		MoveOrders(desc, child, m, orders);
+		for (size_t o = 0; o < orders.size(); ++o)
+			child.ExecuteOrder(desc, 1, orders[o].sourcePlanet, orders[o].destinationPlanet, orders[o].numShips);
+		child.DoTimeStep(desc);
+		best = max(best, SearchCopy(desc, child, depth - 1, orders));
+	}
+	return best;
+}
+
+static int SearchUndo(const GameDesc& desc, GameState& state, GameStateUndo& undo, int depth, vector<Order>& orders) {
+	if (depth == 0) return Evaluate(state);
+	int best = INT_MIN;
+	for (int m = 0; m < Branching; ++m) {
+		MoveOrders(desc, state, m, orders);
+		state.ApplyOrders(desc, 1, orders, undo);
+		state.DoTimeStep(desc, undo);
+		best = max(best, SearchUndo(desc, state, undo, depth - 1, orders));
+		state.Undo(undo);
+		state.Undo(undo);
+	}
+	return best;
+}
+
+static void BenchSearch() {
+	Random r(1);
+	Game game;
+	game.ParseGameState(RandomMap(r, 23, 40));
+	game.state.UpdateStats(game.desc);
+	vector<Order> orders;
+	GameStateUndo undo;
+	for (int depth = 4; depth <= 8; ++depth) {
+		long long t = NowMicros();
+		const int copyValue = SearchCopy(game.desc, game.state, depth, orders);
+		const long long copyTime = NowMicros() - t;
+		t = NowMicros();
+		const int undoValue = SearchUndo(game.desc, game.state, undo, depth, orders);
+		const long long undoTime = NowMicros() - t;
+		printf("search depth %d (%d leaves): copy %.2f ms, undo %.2f ms, %.1fx%s\n",
+			   depth, (int)pow((double)Branching, depth), copyTime / 1000.0, undoTime / 1000.0,
+			   (double)copyTime / max(undoTime, 1LL), (copyValue != undoValue) ? " ERROR: different results" : "");
+	}
+}
+
+// ---------------- views ----------------
+// What BotCppStarterpack does in a turn, once with the views and once with
+// the accessors which return vectors.
+
+static int TurnWithViews(const Game& pw) {
+	int sum = (int)pw.ViewFleets(OwnerMe).empty();
+	const PlanetView myPlanets = pw.ViewPlanets(OwnerMe);
+	for (PlanetView::iterator i = myPlanets.begin(); i != myPlanets.end(); ++i)
+		sum += (*i).numShips;
+	const PlanetView notMyPlanets = pw.ViewPlanets(OwnerNotMe);
+	for (PlanetView::iterator i = notMyPlanets.begin(); i != notMyPlanets.end(); ++i)
+		sum += (*i).growthRate;
+	const FleetView enemyFleets = pw.ViewFleets(OwnerEnemy);
+	for (FleetView::iterator f = enemyFleets.begin(); f != enemyFleets.end(); ++f)
+		sum += (*f).numShips;
+	return sum;
+}
+
+static int TurnWithVectors(const Game& pw) {
+	int sum = (int)pw.MyFleets().empty();
+	const vector<Planet> myPlanets = pw.MyPlanets();
+	for (size_t i = 0; i < myPlanets.size(); ++i)
+		sum += myPlanets[i].numShips;
+	const vector<Planet> notMyPlanets = pw.NotMyPlanets();
+	for (size_t i = 0; i < notMyPlanets.size(); ++i)
+		sum += notMyPlanets[i].growthRate;
+	const vector<Fleet> enemyFleets = pw.EnemyFleets();
+	for (size_t i = 0; i < enemyFleets.size(); ++i)
+		sum += enemyFleets[i].numShips;
+	return sum;
+}
+
+static void BenchViews() {
+	const int sizes[] = { 23, 1000 };
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		Random r(2);
+		Game game;
+		game.ParseGameState(RandomMap(r, sizes[s], sizes[s]));
+		// The planets are neutral otherwise.
+		for (size_t p = 0; p < game.state.planets.size(); ++p)
+			game.state.planets[p].owner = r.Next(3);
+		const int numTurns = 200000 / sizes[s];
+		int sum = 0;
+		long long t = NowMicros();
+		for (int i = 0; i < numTurns; ++i) sum += TurnWithVectors(game);
+		const long long vectorTime = NowMicros() - t;
+		t = NowMicros();
+		for (int i = 0; i < numTurns; ++i) sum -= TurnWithViews(game);
+		const long long viewTime = NowMicros() - t;
+		printf("views %d planets, %d fleets: vectors %.2f us/turn, views %.2f us/turn, %.1fx%s\n",
+			   sizes[s], sizes[s], (double)vectorTime / numTurns, (double)viewTime / numTurns,
+			   (double)vectorTime / max(viewTime, 1LL), (sum != 0) ? " ERROR: different results" : "");
+	}
+}
+
+// ---------------- parse ----------------
+
+// ParseGameState as it was before the in-place parser: lines and tokens
+// are copied into strings, the numbers go through atoi/atof, and the trip
+// time table is rebuilt every time.
+static bool OldParseGameState(Game& game, const string& s) {
+	game.clear();
+	vector<string> lines = Tokenize(s, "\n");
+	for (size_t i = 0; i < lines.size(); ++i) {
+		string& line = lines[i];
+		size_t commentBegin = line.find('#');
+		if (commentBegin != string::npos)
+			line = line.substr(0, commentBegin);
+		if (TrimSpaces(line).size() == 0) continue;
+		
+		vector<string> tokens = Tokenize(line, " ");
+		if (tokens.size() == 0) continue;
+		
+		if (tokens[0] == "P") {
+			if (tokens.size() != 6) return false;
+			game.desc.planets.push_back(PlanetDesc(atoi(tokens[5].c_str()),
+				atof(tokens[1].c_str()), atof(tokens[2].c_str())));
+			game.state.planets.push_back(PlanetState(atoi(tokens[3].c_str()), atoi(tokens[4].c_str())));
+		} else if (tokens[0] == "F") {
+			if (tokens.size() != 7) return false;
+			game.state.fleets.push_back(Fleet(atoi(tokens[1].c_str()), atoi(tokens[2].c_str()),
+				atoi(tokens[3].c_str()), atoi(tokens[4].c_str()),
+				atoi(tokens[5].c_str()), atoi(tokens[6].c_str())));
+		} else
+			return false;
+	}
+	game.desc.BuildDistances();
+	game.state.UpdateArrivals();
+	return true;
+}
+
+// ParseGameState also builds the trip time table, which is O(planets^2),
+// so that is timed on its own as well.
+static void BenchParse() {
+	for (int numPlanets = 10; numPlanets <= 10000; numPlanets *= 10) {
+		Random r(3);
+		const string map = RandomMap(r, numPlanets, numPlanets);
+		Game game;
+		const int numRuns = max(2, 20000 / numPlanets);
+		long long t = NowMicros();
+		for (int i = 0; i < numRuns; ++i)
+			game.ParseGameState(map);
+		const long long parseTime = NowMicros() - t;
+		const string parsed = game.toString();
+		t = NowMicros();
+		for (int i = 0; i < numRuns; ++i)
+			OldParseGameState(game, map);
+		const long long oldParseTime = NowMicros() - t;
+		const bool same = (game.toString() == parsed);
+		t = NowMicros();
+		for (int i = 0; i < numRuns; ++i)
+			game.desc.BuildDistances();
+		const long long distanceTime = NowMicros() - t;
+		printf("parse %d planets, %d fleets (%d kB): old %.1f us, new %.1f us, %.1fx, the trip times alone %.1f us%s\n",
+			   numPlanets, numPlanets, (int)(map.size() / 1024), (double)oldParseTime / numRuns,
+			   (double)parseTime / numRuns, (double)oldParseTime / max(parseTime, 1LL),
+			   (double)distanceTime / numRuns, same ? "" : " ERROR: different results");
+	}
+}
+
+// ---------------- pipe ----------------
+
+static const int NumPipeLines = 1000000;
+
+static int PrintLines(int n) {
+	for (int i = 0; i < n; ++i)
+		printf("%d %d %d\n", i % 100, (i / 100) % 100, i % 1000);
+	return 0;
+}
+
+static void BenchPipe() {
+	Process p(progName + " lines " + to_string(NumPipeLines));
+	p.run();
+	if (!p) { printf("pipe: ERROR: cannot run %s\n", p.cmd.c_str()); return; }
+	const long long t = NowMicros();
+	int numLines = 0;
+	size_t numBytes = 0;
+	const char* line;
+	size_t len;
+	while (!p.outputEOF) {
+		while (p.readLine(line, len, 1000)) {
+			++numLines;
+			numBytes += len + 1;
+		}
+	}
+	const long long dt = NowMicros() - t;
+	printf("pipe %d lines (%d kB): %.0f ms, %.0f ns/line%s\n", numLines, (int)(numBytes / 1024),
+		   dt / 1000.0, dt * 1000.0 / max(numLines, 1), (numLines != NumPipeLines) ? " ERROR: lines missing" : "");
+}
+
+// ---------------- plugin / shm ----------------
+
+// Plays the game with the engine's messages off and returns the time per
+// turn in us, or -1.
+static double PlayMatch(PWConfig config) {
+	config.replayStream = NULL;
+	config.beQuiet = true;
+	streambuf* cerrBuf = cerr.rdbuf(NULL);
+	double turnTime = -1;
+	{
+		PWMatch match(config);
+		PWMatchResult result;
+		if (match.Start()) {
+			const long long t = NowMicros();
+			if (match.Play(PWMainloopCallbacks(), &result) && result.numTurns > 0)
+				turnTime = (double)(NowMicros() - t) / result.numTurns;
+		}
+	}
+	cerr.rdbuf(cerrBuf);
+	cerr.clear();
+	return turnTime;
+}
+
+static void BenchPlugin() {
+	Random r(4);
+	const string mapFilename = WriteTempMap(RandomMap(r, 23, 0));
+	const char* bots[][2] = {
+		{ "./BotExampleBully", "./BotExampleRage" },
+		{ "plugin:BotExampleBully.so", "plugin:BotExampleRage.so" } };
+	double turnTime[2];
+	for (int b = 0; b < 2; ++b) {
+		PWConfig config;
+		config.mapFilename = mapFilename;
+		config.playerCommands.push_back(bots[b][0]);
+		config.playerCommands.push_back(bots[b][1]);
+		turnTime[b] = PlayMatch(config);
+	}
+	unlink(mapFilename.c_str());
+	if (turnTime[0] < 0 || turnTime[1] < 0)
+		printf("plugin: ERROR: a game failed\n");
+	else
+		printf("plugin BotExampleBully vs. BotExampleRage: processes %.1f us/turn, plugins %.1f us/turn, %.1fx\n",
+			   turnTime[0], turnTime[1], turnTime[0] / turnTime[1]);
+}
+
+// With delta, the engine sends only "D" and the go.
+static int IdleBot(bool delta) {
+	Game game;
+	bool isFirstTurn = true;
+	string line;
+	while (getline(cin, line)) {
+		if (line != "go") continue;
+		if (isFirstTurn) {
+			if (delta) game.RequestDelta();
+			game.RequestSharedMemory();
+			isFirstTurn = false;
+		}
+		game.FinishTurn();
+	}
+	return 0;
+}
+
+// An empty turn, and one where the bots get the full state of a big map.
+static void BenchShm() {
+	Random r(5);
+	const string maps[] = { "P 0 0 1 100 5\nP 10 10 2 100 5\n", RandomMap(r, 1000, 0) };
+	const char* bots[] = { " idlebot", " idlebot full" };
+	const char* what[] = { "empty turn", "turn with 1000 planets" };
+	for (int m = 0; m < 2; ++m) {
+		const string mapFilename = WriteTempMap(maps[m]);
+		double turnTime[2];
+		for (int shm = 0; shm < 2; ++shm) {
+			PWConfig config;
+			config.mapFilename = mapFilename;
+			config.maxNumTurns = (m == 0) ? 5000 : 500;
+			config.sharedMemory = (shm != 0);
+			config.playerCommands.push_back(progName + bots[m]);
+			config.playerCommands.push_back(progName + bots[m]);
+			turnTime[shm] = PlayMatch(config);
+		}
+		unlink(mapFilename.c_str());
+		if (turnTime[0] < 0 || turnTime[1] < 0)
+			printf("shm: ERROR: a game failed\n");
+		else
+			printf("shm %s of two bots: pipes %.1f us, shared memory %.1f us, %.1fx\n",
+				   what[m], turnTime[0], turnTime[1], turnTime[0] / turnTime[1]);
+	}
+}
+
+int main(int argc, char** argv) {
+	progName = argv[0];
+	if (argc == 3 && strcmp(argv[1], "lines") == 0) return PrintLines(atoi(argv[2]));
+	if (argc >= 2 && strcmp(argv[1], "idlebot") == 0) return IdleBot(argc == 2);
+
+	const string which = (argc >= 2) ? argv[1] : "";
+	if (which == "" || which == "search") BenchSearch();
+	if (which == "" || which == "views") BenchViews();
+	if (which == "" || which == "parse") BenchParse();
+	if (which == "" || which == "pipe") BenchPipe();
+	if (which == "" || which == "plugin") BenchPlugin();
+	if (which == "" || which == "shm") BenchShm();
+	fflush(stdout);
+	return 0;
+}
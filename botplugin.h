@@ -0,0 +1,43 @@
+/*
+ *  botplugin.h
+ *  PlanetWars
+ *
+ *  code under GPLv3
+ *
+ */
+
+#ifndef __PW__BOTPLUGIN_H__
+#define __PW__BOTPLUGIN_H__
+
+#include "game.h"
+
+// A bot can also be built as shared library, which the engine loads for the
+// player command "plugin:<file>" and calls directly: no process, no text to
+// format and to parse. Build the usual bot source with -DPW_BOT_PLUGIN
+// -fPIC -shared (see the Makefile); instead of main(), it then exports its
+// DoTurn with PW_BOT_PLUGIN_EXPORT.
+//
+// The game is given as the bot would have parsed it, i.e. the bot is player
+// 1. With a time bank, game.timeBank etc. are always set. Each seat loads
+// its own copy of the library, so the bot may keep its globals from turn to
+// turn as it would in its own process. DoTurn runs on a thread of the
+// engine; if it doesn't return in time, the bot loses, and the engine
+// carries on without it.
+//
+// The bot's orders (game.IssueOrder) go to game.orderSink. The host must
+// set game.orderSink to the OrderSink it passes to PWBot_DoTurn before the
+// call; PW_BOT_PLUGIN_EXPORT relies on that and ignores the argument, as
+// the bot's DoTurn only gets the game.
+
+#define PW_BOT_ABI_VERSION 3
+
+extern "C" {
+	typedef int PWBotAbiVersionFunc();
+	typedef void PWBotDoTurnFunc(const Game& game, OrderSink& orders);
+}
+
+#define PW_BOT_PLUGIN_EXPORT(DoTurn) \
+	extern "C" int PWBot_AbiVersion() { return PW_BOT_ABI_VERSION; } \
+	extern "C" void PWBot_DoTurn(const Game& game, OrderSink&) { DoTurn(game); }
+
+#endif
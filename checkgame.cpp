@@ -0,0 +1,666 @@
+/*
+ *  checkgame.cpp
+ *  PlanetWars
+ *
+ *  code under GPLv3
+ *
+ */
+
+// Self-checks of the game code, see "make check".
+//   checkgame states : plays random games and prints a checksum of every
+//     state. make check compares this output of the builds with and without
+//     the SIMD fleet kernels (PW_NO_SIMD), which must be the same.
+//   checkgame selftest : the checks which need only one build. Prints what
+//     failed and returns 1 then.
+//   checkgame fds : plays a few games with bot processes, like a tournament
+//     worker, and checks that no fds or zombie processes are left behind.
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <fstream>
+#include <new>
+#ifdef __linux__
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+#include "game.h"
+#include "engine.h"
+
+using namespace std;
+
+// Counts the heap allocations, see CheckAllocations. new[] and the sized
+// delete go through these.
+static size_t numAllocations = 0;
+
+void* operator new(size_t size) {
+	++numAllocations;
+	void* p = malloc(size ? size : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) { free(p); }
+
+// Our own generator, so the games are the same in every build.
+struct Random {
+	unsigned long long x;
+	Random(unsigned long long seed) : x(seed * 0x9E3779B97F4A7C15ULL + 1) {}
+	int Next(int n) {
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		return (int)((x >> 33) % (unsigned long long)n);
+	}
+};
+
+// A random state with fleets in flight. Some of them arrive in this or the
+// next turn, and the numbers of fleets are no multiples of the SIMD width.
+static string RandomState(Random& r, int numPlanets, int numFleets, int numPlayers) {
+	ostringstream s;
+	for (int p = 0; p < numPlanets; ++p)
+		s << "P " << r.Next(40) << "." << r.Next(10) << " " << r.Next(40)
+		<< " " << r.Next(numPlayers + 1) << " " << r.Next(200) << " " << r.Next(6) << "\n";
+	for (int f = 0; f < numFleets; ++f) {
+		const int total = 1 + r.Next(30);
+		const int turns = (r.Next(4) == 0) ? r.Next(2) : r.Next(total + 1);
+		s << "F " << 1 + r.Next(numPlayers) << " " << 1 + r.Next(100)
+		<< " " << r.Next(numPlanets) << " " << r.Next(numPlanets)
+		<< " " << total << " " << turns << "\n";
+	}
+	return s.str();
+}
+
+static void StartRandomGame(Game& game, Random& r, int& numPlayers) {
+	numPlayers = 1 + r.Next(9);
+	const int numPlanets = 2 + r.Next(50);
+	const int numFleets = (r.Next(3) == 0) ? r.Next(8) : r.Next(500);
+	game.ParseGameState(RandomState(r, numPlanets, numFleets, numPlayers));
+	game.state.UpdateStats(game.desc);
+	game.state.UpdateHash();
+}
+
+// A few random orders of every player. They are merged into existing
+// fleets where possible.
+static void RandomOrders(Game& game, Random& r, int numPlayers) {
+	const int numPlanets = (int)game.NumPlanets();
+	for (int player = 1; player <= numPlayers; ++player) {
+		for (int k = r.Next(6); k > 0; --k) {
+			const int source = r.Next(numPlanets);
+			if (game.state.planets[source].owner != player) continue;
+			const int numShips = 1 + r.Next(std::max(game.state.planets[source].numShips, 1));
+			game.state.ExecuteOrder(game.desc, player, source, r.Next(numPlanets), numShips);
+		}
+	}
+}
+
+static void DoTimeStep(Game& game, int numPlayers) {
+	switch (game.MaxPlayersFor(numPlayers)) {
+		case 2: game.DoTimeStep<2>(); break;
+		case 4: game.DoTimeStep<4>(); break;
+		case 8: game.DoTimeStep<8>(); break;
+		default: game.DoTimeStep<DynamicPlayers>();
+	}
+}
+
+// FNV-1a
+static unsigned long long Checksum(const string& s) {
+	unsigned long long h = 14695981039346656037ULL;
+	for (size_t i = 0; i < s.size(); ++i)
+		h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+	return h;
+}
+
+static const int NumGames = 60;
+static const int NumTurns = 80;
+
+static int States() {
+	for (int g = 0; g < NumGames; ++g) {
+		Random r(g);
+		Game game;
+		int numPlayers;
+		StartRandomGame(game, r, numPlayers);
+		for (int t = 0; t < NumTurns; ++t) {
+			RandomOrders(game, r, numPlayers);
+			DoTimeStep(game, numPlayers);
+			cout << "game " << g << " turn " << t << ": " << hex << Checksum(game.toString()) << dec
+			<< " " << game.state.fleets.size()
+			<< " " << FleetsHighestOwner(game.state.fleets);
+			for (int player = 1; player <= numPlayers; ++player)
+				cout << " " << FleetsHaveOwner(game.state.fleets, player)
+				<< "/" << FleetsNumShips(game.state.fleets, player);
+			cout << "\n";
+		}
+		cout << game.toString();
+	}
+	return 0;
+}
+
+// DoTimeSteps skips the turns without arrivals at once. It must give the
+// same as single steps, also the stats and the hash.
+static bool CheckDoTimeSteps() {
+	bool ok = true;
+	for (int g = 0; g < NumGames; ++g) {
+		Random r(1000 + g);
+		Game game;
+		int numPlayers;
+		StartRandomGame(game, r, numPlayers);
+		for (int t = 0; t < 10; ++t) {
+			RandomOrders(game, r, numPlayers);
+			const int n = 1 + r.Next(20);
+			Game steps(game);
+			for (int k = 0; k < n; ++k)
+				steps.state.DoTimeStep(steps.desc);
+			game.state.DoTimeSteps(n, game.desc);
+			if (game.toString() != steps.toString() ||
+				!game.state.CheckStats(game.desc) ||
+				game.state.Hash() != steps.state.Hash()) {
+				cout << "ERROR: DoTimeSteps(" << n << ") differs from single steps in game " << g << endl;
+				ok = false;
+				break;
+			}
+		}
+	}
+	return ok;
+}
+
+// Once the buffers are big enough, a time step must not allocate anything:
+// neither in place nor with NextTimeStep into a reused state.
+static bool CheckAllocations() {
+	bool ok = true;
+	GameState next;
+	for (int g = 0; g < NumGames && ok; ++g) {
+		Random r(2000 + g);
+		Game game;
+		int numPlayers;
+		StartRandomGame(game, r, numPlayers);
+		for (int t = 0; t < 20 && ok; ++t) {
+			RandomOrders(game, r, numPlayers);
+			game.state.NextTimeStep(game.desc, next); // warm up
+			const size_t before = numAllocations;
+			game.state.NextTimeStep(game.desc, next);
+			if (numAllocations != before) {
+				cout << "ERROR: NextTimeStep allocated " << numAllocations - before << " times in game " << g << endl;
+				ok = false;
+			}
+			game.state.DoTimeStep(game.desc);
+		}
+		// Without new orders, the fleets only get less.
+		game.state.DoTimeStep(game.desc); // warm up
+		const size_t before = numAllocations;
+		for (int t = 0; t < 20; ++t)
+			game.state.DoTimeStep(game.desc);
+		if (numAllocations != before) {
+			cout << "ERROR: DoTimeStep allocated " << numAllocations - before << " times in game " << g << endl;
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+// Reading the fleets through the non-const accessors must keep the indices
+// valid; changing a fleet through a FleetRef must not.
+static bool CheckFleetGeneration() {
+	Random r(3000);
+	Game game;
+	int numPlayers;
+	StartRandomGame(game, r, numPlayers);
+	GameState& state = game.state;
+	if (state.fleets.empty()) return true;
+	state.UpdateArrivals();
+	state.UpdateFleetIndex();
+	int sum = 0;
+	for (Fleets::iterator f = state.fleets.begin(); f != state.fleets.end(); ++f)
+		sum += f->numShips + state.fleets[0].owner;
+	bool ok = true;
+	if (!state.HaveArrivals() || !state.HaveFleetIndex()) {
+		cout << "ERROR: reading the fleets invalidated the indices (" << sum << ")" << endl;
+		ok = false;
+	}
+	state.fleets[state.fleets.size() / 2].Kill();
+	if (state.HaveArrivals() || state.HaveFleetIndex()) {
+		cout << "ERROR: killing a fleet kept the indices valid" << endl;
+		ok = false;
+	}
+	return ok;
+}
+
+// A time step keeps the arrivals index valid; a step with new orders
+// rebuilds it. Both must give the same battles as scanning all fleets.
+static bool CheckArrivals() {
+	for (int g = 0; g < NumGames; ++g) {
+		Random r(4000 + g);
+		Game game;
+		int numPlayers;
+		StartRandomGame(game, r, numPlayers);
+		for (int t = 0; t < 30; ++t) {
+			if (r.Next(2) == 0) RandomOrders(game, r, numPlayers);
+			const GameState& state = game.state;
+			const FleetArrivals& arrivals = game.state.UpdateArrivals();
+			for (size_t p = 0; p < state.planets.size(); ++p) {
+				for (int dt = 0; dt < 4; ++dt) {
+					PlanetState scanned = state.planets[p], indexed = state.planets[p];
+					scanned.FightBattle<DynamicPlayers>((int)p, state.fleets, dt);
+					indexed.FightBattle<DynamicPlayers>((int)p, state.fleets, arrivals, dt);
+					if (scanned.owner != indexed.owner || scanned.numShips != indexed.numShips) {
+						cout << "ERROR: FightBattle with the arrivals differs at planet " << p
+						<< " in " << dt << " turns, game " << g << " turn " << t << endl;
+						return false;
+					}
+				}
+			}
+			DoTimeStep(game, numPlayers);
+			if (!game.state.HaveArrivals()) {
+				cout << "ERROR: the time step did not keep the arrivals in game " << g << endl;
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static int ScanMatchingFleet(const Fleets& fleets, const Fleet& f) {
+	for (size_t i = 0; i < fleets.size(); ++i) {
+		if (fleets.owner[i] == f.owner && fleets.sourcePlanet[i] == f.sourcePlanet &&
+			fleets.destinationPlanet[i] == f.destinationPlanet && fleets.turnsRemaining[i] == f.turnsRemaining)
+			return i;
+	}
+	return -1;
+}
+
+// The fleet index is kept across time steps and orders. It must find the
+// same fleet to merge into as the linear scan: for the keys of all fleets
+// and for random ones.
+static bool CheckFleetIndex() {
+	for (int g = 0; g < NumGames; ++g) {
+		Random r(5000 + g);
+		Game game;
+		int numPlayers;
+		StartRandomGame(game, r, numPlayers);
+		game.state.UpdateFleetIndex();
+		const int numPlanets = (int)game.NumPlanets();
+		for (int t = 0; t < 30; ++t) {
+			if (r.Next(2) == 0) RandomOrders(game, r, numPlayers);
+			const GameState& state = game.state;
+			if (!state.HaveFleetIndex()) {
+				cout << "ERROR: the fleet index was not kept in game " << g << " turn " << t << endl;
+				return false;
+			}
+			for (size_t i = 0; i < state.fleets.size() + 20; ++i) {
+				Fleet f = (i < state.fleets.size()) ? Fleet(state.fleets[i]) :
+					Fleet(1 + r.Next(numPlayers), 1, r.Next(numPlanets), r.Next(numPlanets), 30, r.Next(30));
+				if (state.MatchingExistingFleet(f) != ScanMatchingFleet(state.fleets, f)) {
+					cout << "ERROR: the fleet index differs from the scan in game " << g << " turn " << t << endl;
+					return false;
+				}
+			}
+			DoTimeStep(game, numPlayers);
+		}
+	}
+	return true;
+}
+
+// The incremental hash must equal the full scan after orders and (multiple)
+// time steps, for every pov. The position mirrored for pov has the same
+// hash without renaming, and renaming it back gives the original hash.
+static bool CheckHash() {
+	GameState mirror;
+	for (int g = 0; g < NumGames; ++g) {
+		Random r(6000 + g);
+		Game game;
+		int numPlayers;
+		StartRandomGame(game, r, numPlayers);
+		for (int t = 0; t < 20; ++t) {
+			RandomOrders(game, r, numPlayers);
+			if (r.Next(4) == 0) game.state.DoTimeSteps(1 + r.Next(10), game.desc);
+			else DoTimeStep(game, numPlayers);
+			const GameState& state = game.state;
+			if (!state.HaveHash()) {
+				cout << "ERROR: the hash was not kept in game " << g << " turn " << t << endl;
+				return false;
+			}
+			for (int pov = -1; pov <= numPlayers; ++pov) {
+				if (pov == 0) continue;
+				mirror.AssignPov(state, pov);
+				mirror.UpdateHash();
+				if (state.Hash(pov) != state.HashScan(pov) ||
+					mirror.Hash() != state.Hash(pov) || mirror.Hash(pov) != state.Hash()) {
+					cout << "ERROR: wrong hash for pov " << pov << " in game " << g << " turn " << t << endl;
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+// ApplyOrders and DoTimeStep recorded in an undo log, a few turns deep,
+// then undone: the planets, fleets, stats and hash must be the ones from
+// before. Some of the orders are invalid.
+static bool CheckUndo() {
+	GameStateUndo undo;
+	vector<Order> orders;
+	for (int g = 0; g < NumGames; ++g) {
+		Random r(7000 + g);
+		Game game;
+		int numPlayers;
+		StartRandomGame(game, r, numPlayers);
+		const int numPlanets = (int)game.NumPlanets();
+		for (int t = 0; t < 20; ++t) {
+			Game saved(game);
+			const int depth = 1 + r.Next(3);
+			for (int d = 0; d < depth; ++d) {
+				for (int player = 1; player <= numPlayers; ++player) {
+					orders.clear();
+					for (int k = r.Next(6); k > 0; --k)
+						orders.push_back(Order(r.Next(numPlanets), r.Next(numPlanets), r.Next(120)));
+					game.state.ApplyOrders(game.desc, player, orders, undo);
+				}
+				game.state.DoTimeStep(game.desc, undo);
+			}
+			while (game.state.Undo(undo)) {}
+			if (game.toString() != saved.toString() || !game.state.CheckStats(game.desc) ||
+				game.state.Hash() != saved.state.Hash() || game.state.HashScan() != saved.state.Hash()) {
+				cout << "ERROR: undoing " << depth << " turns differs in game " << g << " turn " << t << endl;
+				return false;
+			}
+			RandomOrders(game, r, numPlayers);
+			DoTimeStep(game, numPlayers);
+		}
+	}
+	return true;
+}
+
+// The number tokens of ParseGameState must give exactly what atoi/atof give,
+// also for the tokens the fast paths hand over to atof.
+static const char* const NumberTokens[] = {
+	"0", "-0", "+0", "-0.0", "0.", ".5", "-.5", "+.5", ".", "-", "+", "--1", "1-", "+-1",
+	"12abc", "abc", "1.5.3", "0x1A", "-0x10", "inf", "-inf", "nan", "1e5", "1E-3", "-1e-400",
+	"1e400", "2.5e+3", "1e", "1e+", "7.e2", "1.7976931348623157e308", "4.9e-324",
+	"9007199254740991", "9007199254740992", "9007199254740993", "-9007199254740993",
+	"9007199254740991.5", "900719925474099.25", "4503599627370496.5", "9007199254740992.0",
+	"0.1234567890123456789012", "0.12345678901234567890123", "123.0000000000000000000001",
+	"0.0000000000000000000001", "0.00000000000000000000001", "-0.000000000000000000000123",
+	"2147483647", "2147483648", "-2147483648", "-2147483649", "4294967296", "4294967297",
+	"9223372036854775807", "9223372036854775808", "-9223372036854775808", "-9223372036854775809",
+	"18446744073709551615", "18446744073709551616", "99999999999999999999999", "000000000000000000000007"
+};
+
+static bool CheckNumber(const string& token) {
+	Game game;
+	const string state = "P " + token + " " + token + " " + token + " " + token + " " + token + "\n"
+		"F " + token + " " + token + " " + token + " " + token + " " + token + " " + token + "\n";
+	const double x = atof(token.c_str());
+	const int i = atoi(token.c_str());
+	if (!game.ParseGameState(state) ||
+		memcmp(&game.desc.planets[0].x, &x, sizeof(x)) != 0 ||
+		memcmp(&game.desc.planets[0].y, &x, sizeof(x)) != 0 ||
+		game.state.planets[0].owner != i || game.state.planets[0].numShips != i ||
+		game.desc.planets[0].growthRate != i ||
+		game.state.fleets.owner[0] != i || game.state.fleets.turnsRemaining[0] != i) {
+		cout << "ERROR: ParseGameState reads \"" << token << "\" not like atoi/atof" << endl;
+		return false;
+	}
+	return true;
+}
+
+static bool CheckNumberParsing() {
+	bool ok = true;
+	for (size_t k = 0; k < sizeof(NumberTokens) / sizeof(NumberTokens[0]); ++k)
+		ok &= CheckNumber(NumberTokens[k]);
+	// Random tokens, mostly digits.
+	static const char chars[] = "0000000000123456789012345678901234567890123456789.-+eE";
+	Random r(8000);
+	for (int k = 0; k < 20000 && ok; ++k) {
+		string token;
+		for (int n = 1 + r.Next(25); n > 0; --n)
+			token += chars[r.Next(sizeof(chars) - 1)];
+		ok &= CheckNumber(token);
+	}
+	return ok;
+}
+
+// The PovRepresentation as it was written with ostream formatting.
+static string PovReference(const Game& game, int pov) {
+	ostringstream s;
+	for (size_t i = 0; i < game.desc.planets.size(); ++i) {
+		s << "P " << game.desc.planets[i].x << " " << game.desc.planets[i].y << " "
+		<< Game::PovSwitch(pov, game.state.planets[i].owner) << " "
+		<< game.state.planets[i].numShips << " " << game.desc.planets[i].growthRate << endl;
+	}
+	const Fleets& fleets = game.state.fleets;
+	for (size_t i = 0; i < fleets.size(); ++i) {
+		s << "F " << Game::PovSwitch(pov, fleets.owner[i]) << " "
+		<< fleets.numShips[i] << " " << fleets.sourcePlanet[i] << " "
+		<< fleets.destinationPlanet[i] << " " << fleets.totalTripLength[i] << " "
+		<< fleets.turnsRemaining[i] << endl;
+	}
+	return s.str();
+}
+
+// Coordinates which take the different formatting paths: small integers,
+// -0, fractions, exponents.
+static double RandomCoordinate(Random& r) {
+	switch (r.Next(6)) {
+		case 0: return r.Next(2000) - 1000;
+		case 1: return -0.0;
+		case 2: return r.Next(1000) / 8.0;
+		case 3: return (r.Next(2000) - 1000) / 7.0 * pow(10.0, r.Next(24) - 10);
+		case 4: return 999999.5 + r.Next(3);
+		default: return r.Next(40) + r.Next(10) / 10.0;
+	}
+}
+
+// PovRenderer must give the same text as the ostream formatting for every
+// pov, also with 10 and more players, where the owner fields are spliced.
+// One renderer is reused, so the cached planet prefixes are checked too.
+static bool CheckPov() {
+	PovRenderer renderer;
+	Random r(9000);
+	Game game;
+	for (int g = 0; g < 300; ++g) {
+		const int numPlayers = 1 + r.Next(14);
+		const int numPlanets = 1 + r.Next(30);
+		// Sometimes the same map, with a few planets moved.
+		if (r.Next(2) == 0 || game.desc.planets.empty()) {
+			game.clear();
+			for (int p = 0; p < numPlanets; ++p)
+				game.desc.planets.push_back(PlanetDesc(r.Next(6), RandomCoordinate(r), RandomCoordinate(r)));
+		} else {
+			for (size_t p = 0; p < game.desc.planets.size(); ++p)
+				if (r.Next(4) == 0) game.desc.planets[p].y = RandomCoordinate(r);
+		}
+		const int n = (int)game.desc.planets.size();
+		game.state.planets.clear();
+		for (int p = 0; p < n; ++p)
+			game.state.planets.push_back(PlanetState(r.Next(numPlayers + 1), r.Next(3) ? r.Next(200) : r.Next(2000000000)));
+		game.state.fleets.clear();
+		for (int f = r.Next(40); f > 0; --f)
+			game.state.fleets.push_back(Fleet(1 + r.Next(numPlayers), 1 + r.Next(1000), r.Next(n), r.Next(n), 1 + r.Next(30), r.Next(30)));
+		renderer.Render(game.desc, game.state);
+		for (int pov = -1; pov <= numPlayers; ++pov) {
+			if (pov == 0) continue;
+			const string reference = PovReference(game, pov);
+			if (renderer.Pov(pov) != reference || game.PovRepresentation(pov) != reference) {
+				cout << "ERROR: PovRenderer differs from the ostream formatting for pov " << pov
+				<< " in state " << g << endl;
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Replays random games the way the engine sends them to bots which asked
+// for deltas: the full state first, then GameStateDelta. Every turn, the
+// state each pov has from ApplyDelta must be the one from parsing the full
+// state. Sometimes a player is dropped, which kills its fleets in place.
+static bool CheckDelta() {
+	GameStateDelta delta;
+	PovRenderer renderer;
+	string deltaText;
+	for (int g = 0; g < NumGames; ++g) {
+		Random r(10000 + g);
+		Game game;
+		int numPlayers;
+		StartRandomGame(game, r, numPlayers);
+		vector<Game> povGames(numPlayers + 1);
+		delta = GameStateDelta();
+		for (int t = 0; t < 40; ++t) {
+			delta.Update(game.state);
+			renderer.Render(game.desc, game.state);
+			for (int pov = 1; pov <= numPlayers; ++pov) {
+				Game& povGame = povGames[pov];
+				bool ok;
+				if (delta.haveDelta) {
+					deltaText.clear();
+					delta.Render(game.state, pov, deltaText);
+					ok = Game::IsDelta(deltaText) && povGame.ApplyDelta(deltaText);
+				}
+				else
+					ok = povGame.ParseGameState(renderer.Pov(pov));
+				Game full;
+				full.ParseGameState(game.PovRepresentation(pov));
+				if (!ok || povGame.toString() != full.toString()) {
+					cout << "ERROR: the state from the deltas differs for pov " << pov
+					<< " in game " << g << " turn " << t << endl;
+					return false;
+				}
+			}
+			if (r.Next(30) == 0) game.state.DropPlayer(1 + r.Next(numPlayers));
+			RandomOrders(game, r, numPlayers);
+			DoTimeStep(game, numPlayers);
+		}
+	}
+	return true;
+}
+
+static bool HasAllDistances(const GameDesc& desc) {
+	if (!desc.HaveDistanceTable()) return false;
+	for (size_t i = 0; i < desc.planets.size(); ++i)
+		for (size_t j = 0; j < desc.planets.size(); ++j)
+			if (desc.Distance(i, j) != GameDesc::CalcDistance(desc.planets[i], desc.planets[j])) return false;
+	return true;
+}
+
+// ParseGameState keeps the trip time table while the planets stay where
+// they are. Moving, adding or removing planets must rebuild it, and a desc
+// which shares the table of another one must see the same trip times.
+static bool CheckDistances() {
+	Random r(11000);
+	Game game;
+	GameDesc shared;
+	string map = RandomState(r, 20, 10, 2);
+	for (int t = 0; t < 200; ++t) {
+		const int change = r.Next(4);
+		if (change == 1) map = RandomState(r, 20, 10, 2); // moved
+		else if (change == 2) map = RandomState(r, 2 + r.Next(40), 10, 2);
+		else if (change == 3) map += "P 1.5 70 0 5 1\n"; // added
+		if (!game.ParseGameState(map) || !HasAllDistances(game.desc)) {
+			cout << "ERROR: wrong trip times after parsing state " << t << endl;
+			return false;
+		}
+		shared.ShareDistances(game.desc);
+		if (!HasAllDistances(shared)) {
+			cout << "ERROR: wrong shared trip times in state " << t << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+static int SelfTest() {
+	bool ok = true;
+	ok &= CheckDoTimeSteps();
+	ok &= CheckAllocations();
+	ok &= CheckFleetGeneration();
+	ok &= CheckArrivals();
+	ok &= CheckFleetIndex();
+	ok &= CheckHash();
+	ok &= CheckUndo();
+	ok &= CheckNumberParsing();
+	ok &= CheckPov();
+	ok &= CheckDelta();
+	ok &= CheckDistances();
+	return ok ? 0 : 1;
+}
+
+#ifdef __linux__
+
+static int NumOpenFds() {
+	DIR* dir = opendir("/proc/self/fd");
+	if (!dir) return -1;
+	int n = 0;
+	while (readdir(dir)) ++n;
+	closedir(dir);
+	return n;
+}
+
+// The bots have to be built. BotCppStarterpack speaks the multi-game
+// protocol and stays in the pool, so there is always one process in it.
+// Its opponents are killed after every game. It uses shared memory in the
+// games which offer it.
+static int Fds() {
+	char mapFilename[] = "/tmp/checkgame-map-XXXXXX";
+	const int mapFd = mkstemp(mapFilename);
+	if (mapFd < 0) { cout << "ERROR: cannot create the map file" << endl; return 1; }
+	close(mapFd);
+	ofstream(mapFilename) << "P 0 0 0 34 2\nP 7 9 1 100 5\nP 14 18 2 100 5\nP 3 15 0 20 3\nP 11 3 0 20 3\n";
+	
+	const char* opponents[] = { "./BotExampleBully", "./BotExampleRage" };
+	const int numGames = 12;
+	bool ok = true;
+	int fdsAfterFirstGame = -1;
+	{
+		PWProcessPool pool;
+		for (int g = 0; g < numGames; ++g) {
+			PWConfig config;
+			config.mapFilename = mapFilename;
+			config.maxNumTurns = 20;
+			config.replayStream = NULL;
+			config.beQuiet = true;
+			config.sharedMemory = (g % 2 == 1);
+			config.playerCommands.push_back("./BotCppStarterpack -shm");
+			config.playerCommands.push_back(opponents[g % 2]);
+			config.processPool = &pool;
+			PWMatch match(config);
+			if (!match.Start() || !match.Play()) {
+				cout << "ERROR: game " << g << " failed" << endl;
+				ok = false;
+				break;
+			}
+			const int fds = NumOpenFds();
+			if (fdsAfterFirstGame < 0) fdsAfterFirstGame = fds;
+			else if (fds > fdsAfterFirstGame) {
+				cout << "ERROR: " << fds - fdsAfterFirstGame << " more fds open after game " << g << endl;
+				ok = false;
+				break;
+			}
+		}
+		// Only the pooled bots may still run, and none may be left unreaped.
+		if (ok && waitpid(-1, NULL, WNOHANG) > 0) {
+			cout << "ERROR: a bot process was not waited for" << endl;
+			ok = false;
+		}
+	}
+	unlink(mapFilename);
+	return ok ? 0 : 1;
+}
+
+#else
+
+static int Fds() { return 0; }
+
+#endif
+
+int main(int argc, char** argv) {
+	if (argc == 2 && strcmp(argv[1], "states") == 0) return States();
+	if (argc == 2 && strcmp(argv[1], "selftest") == 0) return SelfTest();
+	if (argc == 2 && strcmp(argv[1], "fds") == 0) return Fds();
+	cerr << "usage: " << argv[0] << " states|selftest|fds" << endl;
+	return 1;
+}
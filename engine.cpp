@@ -20,61 +20,80 @@
 #include <fstream>
 #include <limits>
 #include <signal.h>
+#include <algorithm>
+#ifndef _WIN32
+#include <pthread.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#endif
 #include "utils.h"
 #include "game.h"
 #include "process.h"
+#include "botplugin.h"
 #include "engine.h"
 
 using namespace std;
 
-static std::vector<Process*> clients;
+PWConfig::PWConfig()
+: mapFilename("maps/map1.txt"), maxTurnTime(5000), maxFirstTurnTime(10000),
+maxNumTurns(200), replayStream(&cout), waitForBot1(false), cpuTimeLimits(false),
+timeBank(-1), timeIncrement(0), timeOverdraft(0), sharedMemory(false), beQuiet(false),
+processPool(NULL) {}
 
-void KillClients() {
-	for (size_t i = 0; i < clients.size(); ++i) {
-		delete clients[i];
-		clients[i] = NULL;
-	}
+PWProcessPool::~PWProcessPool() {
+	for (std::multimap<std::string, Process*>::iterator i = idle.begin(); i != idle.end(); ++i)
+		delete i->second;
 }
 
-static int argc;
-static char** argv;
-
-static std::string mapFilename = "maps/map1.txt";
-static long maxTurnTime = 5000;
-static long maxFirstTurnTime = 10000;
-static int maxNumTurns = 200;
-static std::string logFilename;	
-static std::ofstream logStream;
-static std::ostream* replayStream = &cout;
-static bool waitForBot1 = false;
-static bool beQuiet = false;
-static std::vector<std::string> playerCommands;
-
-void PrintHelpAndExit() {
+Process* PWProcessPool::Take(const std::string& command) {
+	std::multimap<std::string, Process*>::iterator i = idle.find(command);
+	if (i == idle.end()) return NULL;
+	Process* p = i->second;
+	idle.erase(i);
+	return p;
+}
+
+void PWProcessPool::Put(Process* p) {
+	idle.insert(std::make_pair(p->cmd, p));
+}
+
+static void PrintHelpAndExit(const char* progName, bool haveReplayStream) {
 	cerr
 	<< "usage: " << endl
-	<< "  " << argv[0] << " <map_file_name> <max_turn_time> "
+	<< "  " << progName << " <map_file_name> <max_turn_time> "
 	<< "<max_num_turns> <log_filename> <player_one> "
 	<< "<player_two> [more_players]" << endl
 	<< "or" << endl
-	<< "  " << argv[0] << " [-m <map>] [-t <turn_time>] "
-	<< "[-ft <first_turn_time>] "
-	<< "[-n <num_turns>] [-l <logfile>] [-wait] "
-	<< (replayStream ? "[-noout] " : "") << "[-quiet] [--] "
+	<< "  " << progName << " [-m <map>] [-t <turn_time>] "
+	<< "[-ft <first_turn_time>] [-bank <time_bank> [-inc <increment>] "
+	<< "[-overdraft <overdraft>]] "
+	<< "[-n <num_turns>] [-l <logfile>] [-wait] [-cpu] [-shm] "
+	<< (haveReplayStream ? "[-noout] " : "") << "[-quiet] [--] "
 	<< "<player_one> <player_two> [more_players]" << endl
 	<< "with default values:" << endl
 	<< "  map = maps/map1.txt" << endl
 	<< "  turn_time = 5 = timeout in seconds" << endl
 	<< "  first_turn_time = -1 = no timeout" << endl
+	<< "  time_bank = -1 = no chess clock, the turn times count" << endl
+	<< "    otherwise in seconds, increment and overdraft too (default 0)" << endl
 	<< "  num_turns = 200" << endl
 	<< "  logfile = \"\" = no logfile" << endl
-	<< "-wait : wait for player1 to exit (useful for debugging)" << endl;
-	if(replayStream) cerr << "-noout : no replay output" << endl;
+	<< "a player can also be plugin:<file>, a bot built as shared library" << endl
+	<< "-wait : wait for player1 to exit (useful for debugging)" << endl
+	<< "-cpu : the turn times are CPU time of the bots, they get 4 times" << endl
+	<< "  as much wall clock time plus 1 s (only on Linux)" << endl
+	<< "-shm : bots may talk over shared memory instead of stdin/stdout" << endl
+	<< "  (only on Linux, see shmring.h)" << endl;
+	if(haveReplayStream) cerr << "-noout : no replay output" << endl;
 	cerr
 	<< "-quiet : less output" << endl
 	<< "-- : needed if you specify more than 5 players" << endl
 	<< "or" << endl
-	<< "  " << argv[0] << " -h : this help" << endl
+	<< "  " << progName << " -h : this help" << endl
 	;
 	_exit(0);
 }
@@ -86,7 +105,8 @@ static bool looksLikeParamOption(const std::string& arg) {
 	return arg[1] >= 'a' && arg[1] <= 'z';
 }
 
-void ParseParams() {
+static void ParseParams(int argc, char** argv, PWConfig& config) {
+	const bool haveReplayStream = config.replayStream != NULL;
 	bool haveSeperatorStr = false;
 	std::vector<std::string> unnamedParams; unnamedParams.reserve(6);
 	for(int i = 1; i < argc; ++i) {
@@ -96,194 +116,793 @@ void ParseParams() {
 		else if(!looksLikeParamOption(arg))
 			unnamedParams.push_back(arg);
 		else if(arg == "-wait")
-			waitForBot1 = true;
+			config.waitForBot1 = true;
+		else if(arg == "-cpu")
+			config.cpuTimeLimits = true;
+		else if(arg == "-shm")
+			config.sharedMemory = true;
 		else if(arg == "-noout")
-			replayStream = NULL;
+			config.replayStream = NULL;
 		else if(arg == "-quiet")
-			beQuiet = true;
+			config.beQuiet = true;
 		else if(arg == "-h")
-			PrintHelpAndExit();
+			PrintHelpAndExit(argv[0], haveReplayStream);
 		else {
 			++i;
 			if(i >= argc) {
 				cerr << arg << " expecting option or invalid" << endl;
-				PrintHelpAndExit();
+				PrintHelpAndExit(argv[0], haveReplayStream);
 			}
 			if(arg == "-m")
-				mapFilename = argv[i];
+				config.mapFilename = argv[i];
 			else if(arg == "-t")
-				maxTurnTime = atol(argv[i])*1000;
+				config.maxTurnTime = atol(argv[i])*1000;
 			else if(arg == "-ft")
-				maxFirstTurnTime = atol(argv[i])*1000;
+				config.maxFirstTurnTime = atol(argv[i])*1000;
+			else if(arg == "-bank")
+				config.timeBank = (long)(atof(argv[i])*1000);
+			else if(arg == "-inc")
+				config.timeIncrement = (long)(atof(argv[i])*1000);
+			else if(arg == "-overdraft")
+				config.timeOverdraft = (long)(atof(argv[i])*1000);
 			else if(arg == "-n")
-				maxNumTurns = atoi(argv[i]);
+				config.maxNumTurns = atoi(argv[i]);
 			else if(arg == "-l")
-				logFilename = argv[i];
+				config.logFilename = argv[i];
 			else {
 				cerr << "don't understand option: " << arg << endl;
-				PrintHelpAndExit();
+				PrintHelpAndExit(argv[0], haveReplayStream);
 			}
 		}
 	}
 
 	if(unnamedParams.size() >= 6 && !haveSeperatorStr) { // old style parameters
-		mapFilename = unnamedParams[0];
-		maxTurnTime = atol(unnamedParams[1].c_str());
-		maxNumTurns = atoi(unnamedParams[2].c_str());
-		logFilename = unnamedParams[3];
-		playerCommands = std::vector<std::string>( unnamedParams.begin() + 4, unnamedParams.end() );
+		config.mapFilename = unnamedParams[0];
+		config.maxTurnTime = atol(unnamedParams[1].c_str());
+		config.maxNumTurns = atoi(unnamedParams[2].c_str());
+		config.logFilename = unnamedParams[3];
+		config.playerCommands = std::vector<std::string>( unnamedParams.begin() + 4, unnamedParams.end() );
 	}
 	else { // new style parameters
-		playerCommands = unnamedParams;
+		config.playerCommands = unnamedParams;
 	}	
 	
-	if(playerCommands.size() < 2) {
+	if(config.playerCommands.size() < 2) {
 		cerr << "you need at least 2 players" << endl;
-		PrintHelpAndExit();
+		PrintHelpAndExit(argv[0], haveReplayStream);
+	}
+}
+
+// All matches which have clients, so that signalhandler can kill them.
+static std::vector<PWMatch*> runningMatches;
+#ifndef _WIN32
+static pthread_mutex_t runningMatchesMutex = PTHREAD_MUTEX_INITIALIZER;
+struct RunningMatchesLock {
+	RunningMatchesLock() { pthread_mutex_lock(&runningMatchesMutex); }
+	~RunningMatchesLock() { pthread_mutex_unlock(&runningMatchesMutex); }
+};
+#else
+struct RunningMatchesLock {};
+#endif
+
+static void DestroyAllClients() {
+	// No locking here, we are about to exit anyway.
+	for (size_t i = 0; i < runningMatches.size(); ++i)
+		runningMatches[i]->DestroyClients();
+}
+
+static void signalhandler(int) {
+	DestroyAllClients();
+	exit(0);
+}
+
+#ifndef _WIN32
+
+// The CPU time of the calling thread in ms, for the plugins.
+static long currentThreadCpuMillis() {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	timespec t;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t) == 0)
+		return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+#endif
+	return currentTimeMillis();
+}
+
+// The deadline for pthread_cond_timedwait, timeout ms from now.
+static timespec DeadlineIn(long timeout) {
+	timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	const long long nsec = t.tv_nsec + (timeout % 1000) * 1000000LL;
+	t.tv_sec += timeout / 1000 + nsec / 1000000000;
+	t.tv_nsec = nsec % 1000000000;
+	return t;
+}
+
+// Loads a private copy of the file, which is unlinked again once it is
+// open. On failure, error says why.
+static void* dlopenCopy(const std::string& filename, std::string& error) {
+	const char* tmpdir = getenv("TMPDIR");
+	const std::string copyName = std::string((tmpdir && *tmpdir) ? tmpdir : "/tmp") + "/pwplugin-XXXXXX";
+	std::vector<char> name(copyName.begin(), copyName.end());
+	name.push_back('\0');
+	const int out = mkstemp(&name[0]);
+	if(out < 0) {
+		error = copyName + ": " + strerror(errno);
+		return NULL;
+	}
+	const int in = open(filename.c_str(), O_RDONLY);
+	if(in < 0) error = filename + ": " + strerror(errno);
+	char buf[65536];
+	ssize_t n = 0;
+	while(in >= 0 && (n = read(in, buf, sizeof(buf))) > 0)
+		if(write(out, buf, n) != n) {
+			error = &name[0] + std::string(": ") + strerror(errno);
+			break;
+		}
+	if(n < 0) error = filename + ": " + strerror(errno);
+	if(in >= 0) close(in);
+	close(out);
+	void* handle = NULL;
+	if(error.empty() && !(handle = dlopen(&name[0], RTLD_NOW | RTLD_LOCAL)))
+		error = dlerror();
+	unlink(&name[0]);
+	return handle;
+}
+
+// A bot from a shared library, see botplugin.h, loaded with dlopenCopy.
+//
+// DoTurn runs on a thread of the plugin, as a thread can't be stopped from
+// outside: if a plugin doesn't return in time, its player times out and
+// the plugin is abandoned. Its thread deletes it once DoTurn returns, if
+// ever; until then the host game must stay, as the plugin may still read
+// its distances (see PWMatch::Play).
+struct BotPlugin : OrderSink {
+	void* handle;
+	PWBotDoTurnFunc* doTurn;
+	Game game; // as the bot sees it
+	std::vector<Order> orders;
+	long cpuTime; // of the last turn, in ms
+	
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool haveThread, turnPending, quit, abandoned;
+	
+	BotPlugin() : handle(NULL), doTurn(NULL), cpuTime(0), haveThread(false), turnPending(false), quit(false), abandoned(false) {
+		game.orderSink = this;
+		pthread_mutex_init(&mutex, NULL);
+		pthread_cond_init(&cond, NULL);
+	}
+	
+	~BotPlugin() {
+		if(haveThread) {
+			pthread_mutex_lock(&mutex);
+			quit = true;
+			pthread_cond_signal(&cond);
+			pthread_mutex_unlock(&mutex);
+			pthread_join(thread, NULL);
+		}
+		pthread_cond_destroy(&cond);
+		pthread_mutex_destroy(&mutex);
+		if(handle) dlclose(handle);
 	}
 	
-	if(logFilename != "")
-		logStream.open(logFilename.c_str());
+	bool Load(const std::string& filename) {
+		std::string error;
+		handle = dlopenCopy(filename, error);
+		if(!handle) {
+			cerr << "ERROR: cannot load plugin: " << error << endl;
+			return false;
+		}
+		PWBotAbiVersionFunc* abiVersion = (PWBotAbiVersionFunc*)dlsym(handle, "PWBot_AbiVersion");
+		doTurn = (PWBotDoTurnFunc*)dlsym(handle, "PWBot_DoTurn");
+		if(!abiVersion || !doTurn) {
+			cerr << "ERROR: " << filename << " is not a bot plugin" << endl;
+			return false;
+		}
+		if((*abiVersion)() != PW_BOT_ABI_VERSION) {
+			cerr << "ERROR: " << filename << " was built for another engine version" << endl;
+			return false;
+		}
+		if(pthread_create(&thread, NULL, &BotPlugin::Run, this) != 0) {
+			cerr << "ERROR: cannot start a thread for " << filename << endl;
+			return false;
+		}
+		haveThread = true;
+		return true;
+	}
+	
+	// Lets the bot start its turn as player playerID. The times are as in
+	// Game.
+	void StartTurn(const Game& from, int playerID, long timeBank, long timeIncrement, long turnTimeLimit) {
+		game.desc.ShareDistances(from.desc); // the host keeps it until the next turn
+		game.state.AssignPov(from.state, playerID);
+		game.numTurns = from.numTurns;
+		game.timeBank = timeBank;
+		game.timeIncrement = timeIncrement;
+		game.turnTimeLimit = turnTimeLimit;
+		orders.clear();
+		pthread_mutex_lock(&mutex);
+		turnPending = true;
+		pthread_cond_signal(&cond);
+		pthread_mutex_unlock(&mutex);
+	}
+	
+	// Waits at most timeout ms (< 0: no limit) for the turn to end, false
+	// if it didn't.
+	bool WaitTurn(long timeout) {
+		const timespec deadline = DeadlineIn(std::max(timeout, 0L));
+		pthread_mutex_lock(&mutex);
+		while(turnPending)
+			if(timeout < 0) pthread_cond_wait(&cond, &mutex);
+			else if(pthread_cond_timedwait(&cond, &mutex, &deadline) == ETIMEDOUT) break;
+		const bool done = !turnPending;
+		pthread_mutex_unlock(&mutex);
+		return done;
+	}
+	
+	// Instead of delete: leaves the plugin to its thread if it is still in
+	// DoTurn. Returns false then.
+	bool Release() {
+		pthread_mutex_lock(&mutex);
+		abandoned = turnPending;
+		pthread_mutex_unlock(&mutex);
+		if(abandoned) return false;
+		delete this;
+		return true;
+	}
+	
+	static void* Run(void* arg) {
+		BotPlugin& p = *(BotPlugin*)arg;
+		pthread_mutex_lock(&p.mutex);
+		while(!p.quit) {
+			if(!p.turnPending) {
+				pthread_cond_wait(&p.cond, &p.mutex);
+				continue;
+			}
+			pthread_mutex_unlock(&p.mutex);
+			const long startCpuTime = currentThreadCpuMillis();
+			(*p.doTurn)(p.game, p);
+			const long cpuTime = currentThreadCpuMillis() - startCpuTime;
+			pthread_mutex_lock(&p.mutex);
+			p.cpuTime = cpuTime;
+			p.turnPending = false;
+			pthread_cond_signal(&p.cond);
+			if(p.abandoned) {
+				pthread_mutex_unlock(&p.mutex);
+				pthread_detach(p.thread);
+				p.haveThread = false;
+				delete &p;
+				return NULL;
+			}
+		}
+		pthread_mutex_unlock(&p.mutex);
+		return NULL;
+	}
+	
+	void IssueOrder(const Order& order) { orders.push_back(order); }
+};
 
-	if(maxTurnTime < 0)
-		maxTurnTime = (std::numeric_limits<int>::max)();
+#else
 
-	if(maxFirstTurnTime < 0)
-		maxFirstTurnTime = (std::numeric_limits<int>::max)();
+struct BotPlugin {
+	std::vector<Order> orders;
+	long cpuTime;
+	bool Load(const std::string&) {
+		cerr << "ERROR: bot plugins are not supported on Windows" << endl;
+		return false;
+	}
+	void StartTurn(const Game&, int, long, long, long) {}
+	bool WaitTurn(long) { return true; }
+	bool Release() { delete this; return true; }
+};
+
+#endif
+
+static const std::string PluginCommandPrefix = "plugin:";
+
+PWMatch::PWMatch(const PWConfig& _config) : config(_config), pluginLeftBehind(false) {
+	if(config.maxTurnTime < 0)
+		config.maxTurnTime = (std::numeric_limits<int>::max)();
+	
+	if(config.maxFirstTurnTime < 0)
+		config.maxFirstTurnTime = (std::numeric_limits<int>::max)();
 }
 
-void signalhandler(int) {
+PWMatch::~PWMatch() {
+	KillClients();
+}
+
+void PWMatch::DestroyClients() {
 	for (size_t i = 0; i < clients.size(); ++i)
 		if(clients[i]) clients[i]->destroy();
-	exit(0);
 }
 
-bool PW__init(int _argc, char** _argv, std::ostream* _replayStream) {
-	argc = _argc;
-	argv = _argv;
-	replayStream = _replayStream;
-	ParseParams();
-	
+void PWMatch::KillClients() {
+	if(clients.empty()) return;
+	{
+		RunningMatchesLock lock;
+		runningMatches.erase(std::remove(runningMatches.begin(), runningMatches.end(), this), runningMatches.end());
+	}
+	for (size_t i = 0; i < clients.size(); ++i) {
+		delete clients[i];
+		if (plugins[i]) plugins[i]->Release();
+	}
+	clients.clear();
+	plugins.clear();
+}
+
+bool PWMatch::Start() {
 	signal(SIGINT, &signalhandler);
 #ifndef _WIN32
 	signal(SIGHUP, &signalhandler);
 	signal(SIGQUIT, &signalhandler);
+	// A client which quit is handled when writing to it fails.
+	signal(SIGPIPE, SIG_IGN);
 #endif
-
-	// Start the client programs (players).
-	clients.reserve(playerCommands.size());
-	for (size_t i = 0; i < playerCommands.size(); ++i) {
-		std::string command = playerCommands[i];
-		Process* client = new Process(command);
+	
+	if(config.logFilename != "")
+		logStream.open(config.logFilename.c_str());
+	
+	{
+		RunningMatchesLock lock;
+		runningMatches.push_back(this);
+	}
+	
+	// Start the client programs (players). Plugins get a Process which is
+	// never run, so that the clients can be handled all alike.
+	clients.reserve(config.playerCommands.size());
+	plugins.reserve(config.playerCommands.size());
+	std::vector<bool> started(config.playerCommands.size(), false);
+	for (size_t i = 0; i < config.playerCommands.size(); ++i) {
+		std::string command = config.playerCommands[i];
+		Process* client = config.processPool ? config.processPool->Take(command) : NULL;
+		if (client && client->hasExited()) { // quit while it was in the pool
+			delete client;
+			client = NULL;
+		}
+		const bool reused = client != NULL;
+		if (!client) client = new Process(command);
 		clients.push_back(client);
+		plugins.push_back(NULL);
+		
+		if (command.compare(0, PluginCommandPrefix.size(), PluginCommandPrefix) == 0) {
+			plugins[i] = new BotPlugin();
+			if (!plugins[i]->Load(command.substr(PluginCommandPrefix.size()))) {
+				cerr << "ERROR: failed to start client: " << command << endl;
+				KillClients();
+				return false;
+			}
+			continue;
+		}
 		
+		if (reused) continue;
+		client->offerSharedMemory = config.sharedMemory;
 		client->run();
 		if (!*client) {
 			cerr << "ERROR: failed to start client: " << command << endl;
 			KillClients();
 			return false;
 		}
+		started[i] = true;
+	}
+	
+	// They all start up at the same time; we don't wait for them here. A
+	// client which quits right away is noticed at its first turn, when its
+	// output ends, like one which quits later.
+	int numStarted = 0;
+	long long totalSpawnTime = 0, maxSpawnTime = 0;
+	for (size_t i = 0; i < clients.size(); ++i) {
+		if (!started[i]) continue;
+		++numStarted;
+		totalSpawnTime += clients[i]->spawnTime;
+		maxSpawnTime = std::max(maxSpawnTime, clients[i]->spawnTime);
 	}
+	if (!config.beQuiet && numStarted > 0)
+		cerr << "Started " << numStarted << " clients in " << totalSpawnTime / 1000.0
+		<< " ms (slowest " << maxSpawnTime / 1000.0 << " ms)" << endl;
 	
 	return true;
 }
 
-bool PW__mainloop(PWMainloopCallbacks callbacks) {
-	// Initialize the game. Load the map.
-	Game game(maxNumTurns, replayStream, logStream ? &logStream : NULL);	
-	game.WriteLogMessage("initializing");
-	if(!game.LoadMapFromFile(mapFilename)) {
-		cerr << "ERROR: failed to load map: " << mapFilename << endl;
-		return false;
+// How long a client took from getting the state until its go.
+struct ResponseTimes {
+	long total, max;
+	int numTurns;
+	ResponseTimes() : total(0), max(0), numTurns(0) {}
+	void Add(long t) { total += t; max = std::max(max, t); ++numTurns; }
+};
+
+// The CPU time and the peak memory of a client in this game. Processes from
+// the pool already ran before, so we count from the start of the game.
+struct ClientUsage {
+	long startCpuTime;
+	long cpuTime, maxRss; // ms and kB, -1 if unknown
+	ClientUsage() : startCpuTime(0), cpuTime(-1), maxRss(-1) {}
+	bool Update(const Process& p) {
+		long cpu;
+		if (!p.readUsage(cpu, maxRss)) return false;
+		if (cpuTime < 0) startCpuTime = cpu;
+		cpuTime = cpu - startCpuTime;
+		return true;
+	}
+};
+
+// With cpuTimeLimits, how much wall clock time a turn may take at most.
+static long WallTimeCeiling(long turnTime) {
+	if (turnTime >= (std::numeric_limits<int>::max)() / 4) return turnTime;
+	return 4 * turnTime + 1000;
+}
+
+// The CPU time of the bots is only updated in ticks (of 10 ms, usually), so
+// we don't look more often than this.
+static const long CpuTimeCheckInterval = 10;
+
+// The game loop, with the simulation specialized for MaxPlayers.
+template<int MaxPlayers>
+bool PWMatch::PlayGame(Game& game, PWMainloopCallbacks callbacks, PWMatchResult* result) {
+	std::vector<bool> isAlive(clients.size());
+	for (size_t i = 0; i < clients.size(); ++i) {
+		isAlive[i] = (bool)clients[i] || plugins[i];
 	}
 	
-	if(callbacks.OnInitialGame)
-		(*callbacks.OnInitialGame)(game);
+	// Clients which asked for deltas instead of full states (see GameStateDelta).
+	std::vector<bool> wantsDelta(clients.size(), false);
+	// Clients which speak the multi-game protocol, see PWProcessPool.
+	std::vector<bool> multiGame(clients.size(), false);
+	// Clients which want to know their time, see Game::RequestClock.
+	std::vector<bool> wantsClock(clients.size(), false);
 	
-	std::vector<bool> isAlive(clients.size());
+	// With a time bank, what is left of it, by client. Otherwise each turn
+	// has the same turn time.
+	const bool timeControl = config.timeBank >= 0;
+	std::vector<long> timeBank(clients.size(), config.timeBank);
+	
+	// Per client: its orders of this turn, how long it may take, until when
+	// we wait for them and how long it took (in CPU time with cpuTimeLimits).
+	std::vector< std::vector<std::string> > orders(clients.size());
+	std::vector<long> turnTime(clients.size(), 0), wallTime(clients.size(), 0);
+	std::vector<long> deadline(clients.size(), 0);
+	std::vector<long> usedTime(clients.size(), 0);
+	std::vector<ResponseTimes> responseTimes(clients.size());
+	std::vector<ClientUsage> usage(clients.size());
+	// With cpuTimeLimits: the CPU time of the client when its turn started,
+	// -1 if we don't know it and its wall clock time counts.
+	std::vector<long> turnCpuStart(clients.size(), -1);
 	for (size_t i = 0; i < clients.size(); ++i) {
-		isAlive[i] = (bool)clients[i];
+		if (plugins[i]) usage[i].cpuTime = 0;
+		else if (isAlive[i]) usage[i].Update(*clients[i]);
 	}
+	ProcessPoller poller;
+	std::vector<int> readyClients;
 	
 	int numTurns = 0;
+	PovRenderer renderer;
+	GameStateDelta delta;
+	std::string deltaText;
+	const std::string goLine = "go\n";
+	std::string clockLine;
 	// Enter the main game loop.
 	while (game.Winner() < 0) {
 		// Send the game state to the clients.
 		//cout << "The game state:" << endl;
 		//cout << game.toString() << endl;
+		renderer.Render(game.desc, game.state);
+		delta.Update(game.state);
+		if (config.cpuTimeLimits)
+			for (size_t i = 0; i < clients.size(); ++i) {
+				const bool known = *clients[i] && game.state.IsAlive(i + 1) && usage[i].Update(*clients[i]);
+				turnCpuStart[i] = known ? usage[i].cpuTime : -1;
+			}
+		for (size_t i = 0; i < clients.size(); ++i) {
+			if (timeControl)
+				turnTime[i] = std::max(timeBank[i] + config.timeOverdraft, 0L);
+			else
+				turnTime[i] = (numTurns == 0) ? config.maxFirstTurnTime : config.maxTurnTime;
+			wallTime[i] = config.cpuTimeLimits ? WallTimeCeiling(turnTime[i]) : turnTime[i];
+		}
+		// The turn time of each client starts here, including the time it
+		// takes to read the state.
+		const long startTime = currentTimeMillis();
 		for (size_t i = 0; i < clients.size(); ++i) {
 			if (!*clients[i] || !game.state.IsAlive(i + 1)) continue;
 			
-			std::string message = game.PovRepresentation(i + 1) + "go\n";
-			try {
-				*clients[i] << message << flush;
-				game.WriteLogMessage("engine > player" + to_string(i + 1) + ": " +
-									 message);
-			} catch (...) {
+			deltaText.clear();
+			if (wantsDelta[i] && delta.haveDelta)
+				delta.Render(game.state, i + 1, deltaText);
+			clockLine.clear();
+			if (timeControl && wantsClock[i])
+				clockLine = "time " + to_string(timeBank[i]) + " " + to_string(config.timeIncrement) +
+					" " + to_string(turnTime[i]) + "\n";
+			const std::string parts[3] = {
+				deltaText.empty() ? renderer.Pov(i + 1) : deltaText, clockLine, goLine };
+			// What the pipe doesn't take now is written while we wait for
+			// the orders.
+			if (!clients[i]->writeParts(parts, 3)) {
 				cerr << "ERROR while writing to client " << (i+1) << endl;
 				clients[i]->destroy();
+				continue;
 			}
+			if (game.logFile)
+				game.WriteLogMessage("engine > player" + to_string(i + 1) + ": " +
+									 parts[0] + clockLine + goLine);
 		}
 		
-		// Get orders from the clients.
+		// Get orders from the clients. We read from all of them at once, as
+		// their lines come in, but execute the orders afterwards in the order
+		// of the players, so the result doesn't depend on the timing.
 		std::vector<bool> clientDone(clients.size(), false);
-		long startTime = currentTimeMillis();
+		std::vector<bool> crashed(clients.size(), false);
+		size_t numWaiting = 0;
 		for (size_t i = 0; i < clients.size(); ++i) {
-			if (!isAlive[i] || !game.state.IsAlive(i + 1) || clientDone[i]) {
+			orders[i].clear();
+			if (!isAlive[i] || !game.state.IsAlive(i + 1)) {
 				clientDone[i] = true;
 				continue;
 			}
-			try {
-				while(true) {
-					long dt = currentTimeMillis() - startTime;
-					if(dt > ((numTurns == 0) ? maxFirstTurnTime : maxTurnTime)) break;
+			if (plugins[i]) continue;
+			deadline[i] = startTime + ((turnCpuStart[i] >= 0) ? wallTime[i] : turnTime[i]);
+			poller.Add(i, clients[i]);
+			++numWaiting;
+		}
+		// The plugins play one after another, while the processes think. Each
+		// has the turn time for itself. One which doesn't return in time is
+		// left behind and times out below.
+		for (size_t i = 0; i < clients.size(); ++i) {
+			if (!plugins[i] || clientDone[i]) continue;
+			const long pluginStartTime = currentTimeMillis();
+			if (timeControl)
+				plugins[i]->StartTurn(game, i + 1, timeBank[i], config.timeIncrement, turnTime[i]);
+			else
+				plugins[i]->StartTurn(game, i + 1, -1, -1, -1);
+			const bool limited = wallTime[i] < (std::numeric_limits<int>::max)();
+			if (!plugins[i]->WaitTurn(limited ? wallTime[i] : -1)) {
+				pluginLeftBehind = true;
+				continue;
+			}
+			const long dt = currentTimeMillis() - pluginStartTime;
+			usage[i].cpuTime += plugins[i]->cpuTime;
+			usedTime[i] = config.cpuTimeLimits ? plugins[i]->cpuTime : dt;
+			if (dt > wallTime[i] || usedTime[i] > turnTime[i])
+				continue; // times out below
+			clientDone[i] = true;
+			responseTimes[i].Add(dt);
+			if (game.logFile)
+				for (size_t o = 0; o < plugins[i]->orders.size(); ++o) {
+					const Order& order = plugins[i]->orders[o];
+					game.WriteLogMessage("player" + to_string(i + 1) + " > engine: " +
+										 to_string(order.sourcePlanet) + " " + to_string(order.destinationPlanet) + " " + to_string(order.numShips));
+				}
+		}
+		while (numWaiting > 0) {
+			// Clients which are over their deadline are not waited for anymore.
+			const long now = currentTimeMillis();
+			long nextDeadline = (std::numeric_limits<long>::max)();
+			for (size_t i = 0; i < clients.size(); ++i) {
+				if (clientDone[i] || !poller.processes[i]) continue;
+				bool timedOut = now > deadline[i];
+				long until = deadline[i];
+				if (!timedOut && turnCpuStart[i] >= 0 && usage[i].Update(*clients[i])) {
+					// It uses at most as much CPU time as wall clock time
+					// passes (unless it has threads), so we look again when
+					// it could have used up the rest.
+					const long cpuTimeLeft = turnTime[i] - (usage[i].cpuTime - turnCpuStart[i]);
+					if (cpuTimeLeft < 0)
+						timedOut = true;
+					else if (std::max(cpuTimeLeft, CpuTimeCheckInterval) < until - now)
+						until = now + std::max(cpuTimeLeft, CpuTimeCheckInterval);
+				}
+				if (timedOut) {
+					poller.Remove(i);
+					--numWaiting;
+				}
+				else
+					nextDeadline = std::min(nextDeadline, until);
+			}
+			if (numWaiting == 0) break;
+			// Lines which were already read along with earlier ones don't
+			// wake up the poller.
+			readyClients.clear();
+			for (size_t i = 0; i < clients.size(); ++i)
+				if (!clientDone[i] && poller.processes[i] && clients[i]->hasLine())
+					readyClients.push_back(i);
+			if (readyClients.empty() && !poller.Wait(readyClients, nextDeadline - now)) continue;
+			
+			for (size_t r = 0; r < readyClients.size(); ++r) {
+				const size_t i = readyClients[r];
+				if (clientDone[i] || !poller.processes[i]) continue;
+				try {
+					if (clients[i]->hasPendingInput()) {
+						if (!clients[i]->flushSome()) {
+							cerr << "ERROR while writing to client " << (i+1) << endl;
+							clients[i]->destroy();
+						}
+						poller.Update(i);
+					}
 					std::string line;
-					const size_t timeOut = ((numTurns == 0) ? maxFirstTurnTime : maxTurnTime) - dt;
-					if(!clients[i]->readLine(line, timeOut)) break;
-					
-					line = ToLower(TrimSpaces(line));
-					//cerr << "P" << (i+1) << ": " << line << endl;
-					game.WriteLogMessage("player" + to_string(i + 1) + " > engine: " + line);
-					if (line == "go") {						
-						clientDone[i] = true;
-						break;
+					while (clients[i]->readLine(line, 0)) {
+						line = ToLower(TrimSpaces(line));
+						//cerr << "P" << (i+1) << ": " << line << endl;
+						game.WriteLogMessage("player" + to_string(i + 1) + " > engine: " + line);
+						if (line == "go") {
+							clientDone[i] = true;
+							usedTime[i] = currentTimeMillis() - startTime;
+							responseTimes[i].Add(usedTime[i]);
+							if (turnCpuStart[i] >= 0 && usage[i].Update(*clients[i]))
+								usedTime[i] = usage[i].cpuTime - turnCpuStart[i];
+							break;
+						}
+						else if (line == "delta")
+							wantsDelta[i] = true;
+						else if (line == "multigame")
+							multiGame[i] = true;
+						else if (line == "clock")
+							wantsClock[i] = true;
+						else if (line == "shm") {
+							// Its next lines come from the shared memory.
+							if (clients[i]->useSharedMemory())
+								poller.Add(i, clients[i]);
+						}
+						else
+							orders[i].push_back(line);
+					}
+					if (clientDone[i] || clients[i]->outputEOF) {
+						// If it closed its output without go, it will time out below.
+						poller.Remove(i);
+						--numWaiting;
 					}
-					else
-						game.ExecuteOrder(i + 1, line);
+				} catch (...) {
+					// It is dropped after its orders so far are executed.
+					cerr << "WARNING: player " << (i+1) << " crashed." << endl;
+					usage[i].Update(*clients[i]);
+					clients[i]->destroy();
+					crashed[i] = true;
+					poller.Remove(i);
+					--numWaiting;
 				}
-			} catch (...) {
-				cerr << "WARNING: player " << (i+1) << " crashed." << endl;
-				clients[i]->destroy();
+			}
+		}
+		for (size_t i = 0; i < clients.size(); ++i) {
+			poller.Remove(i);
+			if (!isAlive[i]) continue;
+			for (size_t o = 0; o < orders[i].size(); ++o)
+				game.ExecuteOrder(i + 1, orders[i][o]);
+			if (plugins[i] && clientDone[i])
+				for (size_t o = 0; o < plugins[i]->orders.size(); ++o)
+					game.ExecuteOrder(i + 1, plugins[i]->orders[o]);
+			if (crashed[i]) {
 				game.state.DropPlayer(i + 1);
 				isAlive[i] = false;
 			}
 		}
 		for (size_t i = 0; i < clients.size(); ++i) {
 			if (!isAlive[i] || !game.state.IsAlive(i + 1)) continue;
-			if (clientDone[i]) continue;
+			if (clientDone[i]) {
+				// We look at the CPU time only now and then, so it may be a
+				// bit over its time, which is not charged.
+				if (timeControl)
+					timeBank[i] += config.timeIncrement - std::min(usedTime[i], turnTime[i]);
+				continue;
+			}
 			
 			cerr << "WARNING: player " << (i+1) << " timed out." << endl;
+			usage[i].Update(*clients[i]);
 			clients[i]->destroy();
 			game.state.DropPlayer(i + 1);
 			isAlive[i] = false;
 		}
 		++numTurns;
-		if(!beQuiet) cerr << "Turn " << numTurns << endl;
-		game.DoTimeStep();
+		if(!config.beQuiet) cerr << "Turn " << numTurns << endl;
+		game.DoTimeStep<MaxPlayers>();
 		if(callbacks.OnNextGameState)
 			(*callbacks.OnNextGameState)(game);
 	}
 	
-	if(beQuiet) cerr << "after " << numTurns << " turns: "; // so we know at least the numturns
+	if(config.beQuiet) cerr << "after " << numTurns << " turns: "; // so we know at least the numturns
 	if (game.Winner() > 0) {
 		cerr << "Player " << game.Winner() << " Wins!" << endl;
 	} else {
 		cerr << "Draw!" << endl;
 	}
 	
-	if(waitForBot1)
+	for (size_t i = 0; i < clients.size(); ++i) {
+		if (*clients[i]) usage[i].Update(*clients[i]);
+		if (usage[i].cpuTime < 0) continue;
+		game.WriteLogMessage("player" + to_string(i + 1) + " used " + to_string(usage[i].cpuTime) + " ms CPU time" +
+							 ((usage[i].maxRss >= 0) ? ", " + to_string(usage[i].maxRss) + " kB max RSS" : ""));
+	}
+	
+	if(result) {
+		result->winner = std::max(game.Winner(), 0);
+		result->numTurns = numTurns;
+		result->avgResponseTime.assign(clients.size(), 0);
+		result->maxResponseTime.assign(clients.size(), 0);
+		for (size_t i = 0; i < clients.size(); ++i) {
+			if (responseTimes[i].numTurns == 0) continue;
+			result->avgResponseTime[i] = responseTimes[i].total / responseTimes[i].numTurns;
+			result->maxResponseTime[i] = responseTimes[i].max;
+		}
+		result->cpuTime.resize(clients.size());
+		result->maxRss.resize(clients.size());
+		for (size_t i = 0; i < clients.size(); ++i) {
+			result->cpuTime[i] = usage[i].cpuTime;
+			result->maxRss[i] = usage[i].maxRss;
+		}
+	}
+	
+	if(!config.beQuiet) {
+		for (size_t i = 0; i < clients.size(); ++i) {
+			if (responseTimes[i].numTurns == 0) continue;
+			cerr << "Player " << (i+1) << " response time: "
+			<< responseTimes[i].total / responseTimes[i].numTurns << " ms average, "
+			<< responseTimes[i].max << " ms max" << endl;
+		}
+		for (size_t i = 0; i < clients.size(); ++i) {
+			if (usage[i].cpuTime < 0) continue;
+			cerr << "Player " << (i+1) << " CPU time: " << usage[i].cpuTime << " ms";
+			if (usage[i].maxRss >= 0) cerr << ", max RSS: " << usage[i].maxRss << " kB";
+			cerr << endl;
+		}
+	}
+	
+	if(config.waitForBot1)
 		clients[0]->waitForExit();
 	
+	if(config.processPool) {
+		const std::string endLine = "end\n";
+		for (size_t i = 0; i < clients.size(); ++i) {
+			if (!multiGame[i] || !isAlive[i] || !*clients[i]) continue;
+			if (!clients[i]->writeParts(&endLine, 1)) continue;
+			game.WriteLogMessage("engine > player" + to_string(i + 1) + ": " + endLine);
+			config.processPool->Put(clients[i]);
+			clients[i] = NULL;
+		}
+	}
+	
 	KillClients();
 	return true;
 }
+
+bool PWMatch::Play(PWMainloopCallbacks callbacks, PWMatchResult* result) {
+	// Initialize the game. Load the map.
+	Game* game = new Game(config.maxNumTurns, config.replayStream, logStream.is_open() ? &logStream : NULL);
+	game->WriteLogMessage("initializing");
+	bool ok = game->LoadMapFromFile(config.mapFilename);
+	if(!ok) {
+		cerr << "ERROR: failed to load map: " << config.mapFilename << endl;
+	} else {
+		game->state.UpdateStats(game->desc);
+		
+		if(callbacks.OnInitialGame)
+			(*callbacks.OnInitialGame)(*game);
+		
+		switch(game->MaxPlayersFor(clients.size())) {
+			case 2: ok = PlayGame<2>(*game, callbacks, result); break;
+			case 4: ok = PlayGame<4>(*game, callbacks, result); break;
+			case 8: ok = PlayGame<8>(*game, callbacks, result); break;
+			default: ok = PlayGame<DynamicPlayers>(*game, callbacks, result);
+		}
+	}
+	// A plugin which was left behind may still read the distances of the
+	// game, so it has to stay then.
+	if(!pluginLeftBehind)
+		delete game;
+	return ok;
+}
+
+// The match of PW__init and PW__mainloop.
+static PWMatch* mainMatch = NULL;
+
+bool PW__init(int argc, char** argv, std::ostream* replayStream) {
+	PWConfig config;
+	config.replayStream = replayStream;
+	ParseParams(argc, argv, config);
+	
+	delete mainMatch;
+	mainMatch = new PWMatch(config);
+	return mainMatch->Start();
+}
+
+bool PW__mainloop(PWMainloopCallbacks callbacks, PWMatchResult* result) {
+	return mainMatch->Play(callbacks, result);
+}
@@ -11,15 +11,102 @@
 #define __PW__ENGINE_H__
 
 #include <ostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
 
 struct Game;
+struct Process;
+struct BotPlugin;
 
 struct PWMainloopCallbacks {
 	void (*OnInitialGame)(const Game& game);
 	void (*OnNextGameState)(const Game& game);
 };
 
+// The outcome of a game, e.g. for tournaments.
+struct PWMatchResult {
+	int winner; // 0 for a draw
+	int numTurns;
+	std::vector<long> avgResponseTime, maxResponseTime; // ms, by player
+	std::vector<long> cpuTime, maxRss; // ms and kB, by player, -1 if unknown
+	PWMatchResult() : winner(0), numTurns(0) {}
+};
+
+// Bot processes which are kept running between matches. Bots which speak
+// the multi-game protocol (they say "multigame" during a game) get "end"
+// after the game instead of being killed, and then they play the next game
+// of the same command. Others, and ones which crashed or timed out, are
+// killed as usual. Not thread-safe, use one per thread.
+struct PWProcessPool {
+	std::multimap<std::string, Process*> idle; // by command
+	
+	PWProcessPool() {}
+	~PWProcessPool(); // kills the idle ones
+	// Returns an idle process of that command, or NULL.
+	Process* Take(const std::string& command);
+	void Put(Process* p);
+	
+private:
+	PWProcessPool(const PWProcessPool&);
+	PWProcessPool& operator=(const PWProcessPool&);
+};
+
+// How a game is played. Times are in ms, negative means no limit.
+struct PWConfig {
+	std::string mapFilename;
+	long maxTurnTime, maxFirstTurnTime;
+	int maxNumTurns;
+	std::string logFilename;
+	std::ostream* replayStream;
+	bool waitForBot1; // wait for player1 to exit at the end
+	// The turn times are CPU time of the bots instead of wall clock time, so
+	// that a busy machine doesn't make them time out. Where the CPU time of a
+	// bot can't be read, its wall clock time counts as usual.
+	bool cpuTimeLimits;
+	// A chess clock instead of the turn times: every player starts with
+	// timeBank, each turn takes its time from it and then timeIncrement is
+	// added. The bank may go down to -timeOverdraft, which the following
+	// increments have to pay back. Off if timeBank < 0. Bots which asked for
+	// it get their time every turn, see Game::RequestClock.
+	long timeBank, timeIncrement, timeOverdraft;
+	// Offer the bots the shared memory transport, see shmring.h.
+	bool sharedMemory;
+	bool beQuiet;
+	std::vector<std::string> playerCommands;
+	PWProcessPool* processPool; // if set, clients come from there and go back
+	PWConfig();
+};
+
+// One game with its own clients. It has no global state, so several of
+// them can be played at once, e.g. on threads. A plugin which hangs only
+// loses its own match.
+struct PWMatch {
+	PWConfig config;
+	std::vector<Process*> clients;
+	std::vector<BotPlugin*> plugins; // by player, NULL if it is a process
+	bool pluginLeftBehind; // a plugin which didn't return in time, see Play
+	std::ofstream logStream;
+	
+	PWMatch(const PWConfig& config);
+	~PWMatch();
+	// Runs the clients.
+	bool Start();
+	// Plays the game till the end and kills the clients.
+	bool Play(PWMainloopCallbacks callbacks = PWMainloopCallbacks(), PWMatchResult* result = NULL);
+	void KillClients();
+	void DestroyClients(); // like KillClients but only sends the signal
+	
+private:
+	template<int MaxPlayers>
+	bool PlayGame(Game& game, PWMainloopCallbacks callbacks, PWMatchResult* result);
+	PWMatch(const PWMatch&);
+	PWMatch& operator=(const PWMatch&);
+};
+
+// Parses the playgame command line and starts its match.
 bool PW__init(int argc, char** argv, std::ostream* replayStream);
-bool PW__mainloop(PWMainloopCallbacks callbacks = PWMainloopCallbacks());
+bool PW__mainloop(PWMainloopCallbacks callbacks = PWMainloopCallbacks(), PWMatchResult* result = NULL);
 
 #endif
@@ -16,15 +16,41 @@
 #include <string>
 #include <set>
 #include <math.h>
+#include <cstdio>
 #include <sstream>
 #include <map>
 #include <iterator>
 #include <fstream>
 #include <cstdlib>
 #include <iostream>
+#include <limits>
+#include <climits>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#if defined(PW_NO_SIMD)
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifdef __linux__
+#include <streambuf>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#endif
 #include "game.h"
+#include "shmring.h"
 #include "utils.h"
 
+#ifdef CHECKSTATS
+#include <cassert>
+#define CHECK_STATS(desc) assert(CheckStats(desc))
+#else
+#define CHECK_STATS(desc)
+#endif
+
 // Writes a string which represents the current game state. This string
 // conforms to the Point-in-Time format from the project Wiki.
 //
@@ -34,22 +60,176 @@
 // game state to individual players, so that they can always assume that
 // they are player number 1.
 std::string Game::PovRepresentation(int pov) {
-	std::ostringstream s;
+	PovRenderer renderer;
+	renderer.Render(desc, state);
+	return renderer.Pov(pov);
+}
+
+static void AppendInt(std::string& s, int v) {
+	char buf[16];
+	char* end = buf + sizeof(buf);
+	char* p = end;
+	unsigned int u = (v < 0) ? 0u - (unsigned int)v : (unsigned int)v;
+	do { *--p = '0' + u % 10; u /= 10; } while (u);
+	if (v < 0) *--p = '-';
+	s.append(p, end);
+}
+
+// Same as std::ostream << v with the default flags, i.e. "%g".
+static void AppendDouble(std::string& s, double v) {
+	if (v > -1e6 && v < 1e6 && v == (int)v && v != 0) { // 0 might be -0
+		AppendInt(s, (int)v);
+		return;
+	}
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%g", v);
+	s += buf;
+}
+
+// Appends " numShips source destination totalTripLength turnsRemaining\n".
+static void AppendFleetFields(std::string& s, const Fleets& fleets, int i) {
+	s += ' ';
+	AppendInt(s, fleets.numShips[i]);
+	s += ' ';
+	AppendInt(s, fleets.sourcePlanet[i]);
+	s += ' ';
+	AppendInt(s, fleets.destinationPlanet[i]);
+	s += ' ';
+	AppendInt(s, fleets.totalTripLength[i]);
+	s += ' ';
+	AppendInt(s, fleets.turnsRemaining[i]);
+	s += '\n';
+}
+
+static inline bool SameDouble(double a, double b) { return memcmp(&a, &b, sizeof(double)) == 0; }
+
+void PovRenderer::Render(const GameDesc& desc, const GameState& state) {
+	text.clear();
+	ownerFields.clear();
+	if (planetPrefixes.size() != desc.planets.size())
+		planetPrefixes.resize(desc.planets.size());
 	for (size_t i = 0; i < desc.planets.size(); ++i) {
-		s
-		<< "P " << desc.planets[i].x << " " << desc.planets[i].y << " "
-		<< PovSwitch(pov, state.planets[i].owner) << " "
-		<< state.planets[i].numShips << " "
-		<< desc.planets[i].growthRate << std::endl;
+		const PlanetDesc& planet = desc.planets[i];
+		PlanetPrefix& prefix = planetPrefixes[i];
+		if (prefix.text.empty() || !SameDouble(prefix.x, planet.x) || !SameDouble(prefix.y, planet.y)) {
+			prefix.x = planet.x;
+			prefix.y = planet.y;
+			prefix.text = "P ";
+			AppendDouble(prefix.text, planet.x);
+			prefix.text += ' ';
+			AppendDouble(prefix.text, planet.y);
+			prefix.text += ' ';
+		}
+		text += prefix.text;
+		OwnerField field = { text.size(), 0, state.planets[i].owner };
+		AppendInt(text, field.owner);
+		field.len = text.size() - field.pos;
+		ownerFields.push_back(field);
+		text += ' ';
+		AppendInt(text, state.planets[i].numShips);
+		text += ' ';
+		AppendInt(text, planet.growthRate);
+		text += '\n';
+	}
+	const Fleets& fleets = state.fleets;
+	for (size_t i = 0; i < fleets.size(); ++i) {
+		text += "F ";
+		OwnerField field = { text.size(), 0, fleets.owner[i] };
+		AppendInt(text, field.owner);
+		field.len = text.size() - field.pos;
+		ownerFields.push_back(field);
+		AppendFleetFields(text, fleets, i);
+	}
+}
+
+const std::string& PovRenderer::Pov(int pov) {
+	if (pov < 0 || pov == 1) return text;
+	if (pov < 10) {
+		// Owners 1 and pov have the same length, so we can patch in place.
+		povText = text;
+		for (size_t i = 0; i < ownerFields.size(); ++i) {
+			const OwnerField& field = ownerFields[i];
+			if (field.owner == 1) povText[field.pos] = '0' + pov;
+			else if (field.owner == pov) povText[field.pos] = '1';
+		}
+		return povText;
+	}
+	povText.clear();
+	size_t last = 0;
+	for (size_t i = 0; i < ownerFields.size(); ++i) {
+		const OwnerField& field = ownerFields[i];
+		if (field.owner != 1 && field.owner != pov) continue;
+		povText.append(text, last, field.pos - last);
+		AppendInt(povText, Game::PovSwitch(pov, field.owner));
+		last = field.pos + field.len;
+	}
+	povText.append(text, last, std::string::npos);
+	return povText;
+}
+
+static inline bool SameFleet(const Fleets& a, int i, const Fleets& b, int j) {
+	return a.owner[i] == b.owner[j] &&
+		a.numShips[i] == b.numShips[j] &&
+		a.sourcePlanet[i] == b.sourcePlanet[j] &&
+		a.destinationPlanet[i] == b.destinationPlanet[j] &&
+		a.totalTripLength[i] == b.totalTripLength[j] &&
+		a.turnsRemaining[i] == b.turnsRemaining[j];
+}
+
+void GameStateDelta::Update(const GameState& state) {
+	changedPlanets.clear();
+	removedFleets.clear();
+	firstNewFleet = 0;
+	haveDelta = haveLast && lastPlanets.size() == state.planets.size();
+	if (haveDelta) {
+		for (size_t p = 0; p < state.planets.size(); ++p) {
+			if (lastPlanets[p].owner != state.planets[p].owner ||
+				lastPlanets[p].numShips != state.planets[p].numShips)
+				changedPlanets.push_back(p);
+		}
+		// Fleets keep their order, so the aged old fleets which are still
+		// there come first. Whatever doesn't match is sent as removed / new;
+		// either way, ApplyDelta ends up with exactly the current fleets.
+		FleetsTimeStep(lastFleets);
+		size_t j = 0;
+		for (size_t i = 0; i < lastFleets.size(); ++i) {
+			if (j < state.fleets.size() && SameFleet(lastFleets, i, state.fleets, j))
+				++j;
+			else
+				removedFleets.push_back(i);
+		}
+		firstNewFleet = j;
 	}
-	for (Fleets::iterator f = state.fleets.begin(); f != state.fleets.end(); ++f) {
-		s
-		<< "F " << PovSwitch(pov, f->owner) << " "
-		<< f->numShips << " " << f->sourcePlanet << " "
-		<< f->destinationPlanet << " " << f->totalTripLength << " "
-		<< f->turnsRemaining << std::endl;
+	lastPlanets = state.planets;
+	lastFleets = state.fleets;
+	haveLast = true;
+}
+
+void GameStateDelta::Render(const GameState& state, int pov, std::string& out) const {
+	out += "D\n";
+	for (size_t i = 0; i < changedPlanets.size(); ++i) {
+		const int p = changedPlanets[i];
+		out += "C ";
+		AppendInt(out, p);
+		out += ' ';
+		AppendInt(out, Game::PovSwitch(pov, state.planets[p].owner));
+		out += ' ';
+		AppendInt(out, state.planets[p].numShips);
+		out += '\n';
+	}
+	if (!removedFleets.empty()) {
+		out += 'R';
+		for (size_t i = 0; i < removedFleets.size(); ++i) {
+			out += ' ';
+			AppendInt(out, removedFleets[i]);
+		}
+		out += '\n';
+	}
+	for (size_t i = firstNewFleet; i < state.fleets.size(); ++i) {
+		out += "F ";
+		AppendInt(out, Game::PovSwitch(pov, state.fleets.owner[i]));
+		AppendFleetFields(out, state.fleets, i);
 	}
-	return s.str();
 }
 
 // Carries out the point-of-view switch operation, so that each player can
@@ -68,42 +248,213 @@ int Game::PovSwitch(int pov, int playerID) {
 	return playerID;
 }
 
-//Resolves the battle at planet p, if there is one.
-//* Removes all fleets involved in the battle
-//* Sets the number of ships and owner of the planet according the outcome
-void PlanetState::FightBattle(int myPlanetIndex, const std::vector<Fleet>& fleets, int dt) {
-	PlanetState& p = *this;
-#ifdef ONLY2PLAYERS
-	int participants[3] = {0,0,0};
-#else
-	std::vector<int> participants( std::max(3, p.owner + 1) ); // index = owner
+void GameState::AssignPov(const GameState& from, int pov) {
+	clear();
+	planets = from.planets;
+	for (Planets::iterator p = planets.begin(); p != planets.end(); ++p)
+		p->owner = Game::PovSwitch(pov, p->owner);
+	fleets = from.fleets;
+	for (size_t i = 0; i < fleets.size(); ++i)
+		fleets.owner[i] = Game::PovSwitch(pov, fleets.owner[i]);
+}
+
+// ---------------- Fleets kernels ----------------
+// The few SIMD operations we need, on PW_SIMD_WIDTH ints at once. With
+// PW_NO_SIMD, only the plain loops are used (make check compares both).
+
+#if defined(PW_NO_SIMD)
+#elif defined(__AVX2__)
+#define PW_SIMD_WIDTH 8
+typedef __m256i SimdInt;
+static inline SimdInt SimdLoad(const int* p) { return _mm256_loadu_si256((const __m256i*)p); }
+static inline void SimdStore(int* p, SimdInt v) { _mm256_storeu_si256((__m256i*)p, v); }
+static inline SimdInt SimdSet(int x) { return _mm256_set1_epi32(x); }
+static inline SimdInt SimdSub(SimdInt a, SimdInt b) { return _mm256_sub_epi32(a, b); }
+static inline SimdInt SimdAdd(SimdInt a, SimdInt b) { return _mm256_add_epi32(a, b); }
+static inline SimdInt SimdAnd(SimdInt a, SimdInt b) { return _mm256_and_si256(a, b); }
+static inline SimdInt SimdOr(SimdInt a, SimdInt b) { return _mm256_or_si256(a, b); }
+static inline SimdInt SimdCmpEq(SimdInt a, SimdInt b) { return _mm256_cmpeq_epi32(a, b); }
+static inline SimdInt SimdCmpGt(SimdInt a, SimdInt b) { return _mm256_cmpgt_epi32(a, b); }
+static inline SimdInt SimdMax(SimdInt a, SimdInt b) { return _mm256_max_epi32(a, b); }
+// one bit per lane
+static inline int SimdMask(SimdInt a) { return _mm256_movemask_ps(_mm256_castsi256_ps(a)); }
+#elif defined(__SSE2__)
+#define PW_SIMD_WIDTH 4
+typedef __m128i SimdInt;
+static inline SimdInt SimdLoad(const int* p) { return _mm_loadu_si128((const __m128i*)p); }
+static inline void SimdStore(int* p, SimdInt v) { _mm_storeu_si128((__m128i*)p, v); }
+static inline SimdInt SimdSet(int x) { return _mm_set1_epi32(x); }
+static inline SimdInt SimdSub(SimdInt a, SimdInt b) { return _mm_sub_epi32(a, b); }
+static inline SimdInt SimdAdd(SimdInt a, SimdInt b) { return _mm_add_epi32(a, b); }
+static inline SimdInt SimdAnd(SimdInt a, SimdInt b) { return _mm_and_si128(a, b); }
+static inline SimdInt SimdOr(SimdInt a, SimdInt b) { return _mm_or_si128(a, b); }
+static inline SimdInt SimdCmpEq(SimdInt a, SimdInt b) { return _mm_cmpeq_epi32(a, b); }
+static inline SimdInt SimdCmpGt(SimdInt a, SimdInt b) { return _mm_cmpgt_epi32(a, b); }
+static inline SimdInt SimdMax(SimdInt a, SimdInt b) { // SSE2 has no _mm_max_epi32
+	SimdInt aIsGreater = _mm_cmpgt_epi32(a, b);
+	return _mm_or_si128(_mm_and_si128(aIsGreater, a), _mm_andnot_si128(aIsGreater, b));
+}
+// one bit per lane
+static inline int SimdMask(SimdInt a) { return _mm_movemask_ps(_mm_castsi128_ps(a)); }
+#endif
+
+#ifdef PW_SIMD_WIDTH
+static const int SimdFullMask = (1 << PW_SIMD_WIDTH) - 1;
+
+static inline int SimdHorizontalSum(SimdInt a) {
+	int v[PW_SIMD_WIDTH];
+	SimdStore(v, a);
+	int sum = 0;
+	for (int i = 0; i < PW_SIMD_WIDTH; ++i) sum += v[i];
+	return sum;
+}
+
+static inline int SimdHorizontalMax(SimdInt a) {
+	int v[PW_SIMD_WIDTH];
+	SimdStore(v, a);
+	int m = v[0];
+	for (int i = 1; i < PW_SIMD_WIDTH; ++i) m = std::max(m, v[i]);
+	return m;
+}
+#endif
+
+// Pointer to the data of the array. NULL if empty.
+template<typename T>
+static inline T* Data(std::vector<T>& v) { return v.empty() ? NULL : &v[0]; }
+template<typename T>
+static inline const T* Data(const std::vector<T>& v) { return v.empty() ? NULL : &v[0]; }
+
+void FleetsTimeStep(Fleets& fleets) {
+	FleetsTimeSteps(fleets, 1);
+}
+
+void FleetsTimeSteps(Fleets& fleets, int k) {
+	++fleets.generation;
+	int* turns = Data(fleets.turnsRemaining);
+	const size_t n = fleets.size();
+	size_t i = 0;
+#ifdef PW_SIMD_WIDTH
+	const SimdInt vk = SimdSet(k);
+	for (; i + PW_SIMD_WIDTH <= n; i += PW_SIMD_WIDTH) {
+		SimdInt t = SimdLoad(turns + i);
+		SimdStore(turns + i, SimdAnd(SimdSub(t, vk), SimdCmpGt(t, vk)));
+	}
 #endif
-	participants[p.owner] = p.numShips;
+	for (; i < n; ++i) {
+		if (turns[i] > k)
+			turns[i] -= k;
+		else
+			turns[i] = 0;
+	}
+}
+
+void RemoveFinalFleets(Fleets& fleets) {
+	int* const fields[] = {
+		Data(fleets.owner), Data(fleets.numShips),
+		Data(fleets.sourcePlanet), Data(fleets.destinationPlanet),
+		Data(fleets.turnsRemaining), Data(fleets.totalTripLength) };
+	const size_t numFields = sizeof(fields) / sizeof(fields[0]);
+	const int* turns = Data(fleets.turnsRemaining);
+	const size_t n = fleets.size();
+	size_t i = 0;
+	
+	// The leading fleets which all stay don't need to be moved.
+#ifdef PW_SIMD_WIDTH
+	const SimdInt zero = SimdSet(0);
+	while (i + PW_SIMD_WIDTH <= n && SimdMask(SimdCmpGt(SimdLoad(turns + i), zero)) == SimdFullMask)
+		i += PW_SIMD_WIDTH;
+#endif
+	while (i < n && turns[i] > 0) ++i;
 	
-	for (std::vector<Fleet>::const_iterator f = fleets.begin(); f != fleets.end(); ++f) {
-		if (f->turnsRemaining == dt && f->destinationPlanet == myPlanetIndex) {
-#ifndef ONLY2PLAYERS
-			participants.resize( std::max(participants.size(), (size_t)f->owner + 1) );
+	size_t numLeft = i;
+	while (i < n) {
+#ifdef PW_SIMD_WIDTH
+		// Move whole blocks if they all stay.
+		if (i + PW_SIMD_WIDTH <= n && SimdMask(SimdCmpGt(SimdLoad(turns + i), zero)) == SimdFullMask) {
+			for (size_t k = 0; k < numFields; ++k)
+				SimdStore(fields[k] + numLeft, SimdLoad(fields[k] + i));
+			numLeft += PW_SIMD_WIDTH;
+			i += PW_SIMD_WIDTH;
+			continue;
+		}
 #endif
-			participants[f->owner] += f->numShips;
+		if (turns[i] > 0) {
+			for (size_t k = 0; k < numFields; ++k)
+				fields[k][numLeft] = fields[k][i];
+			++numLeft;
 		}
+		++i;
 	}
 	
+	fleets.resize(numLeft);
+}
+
+int FleetsNumShips(const Fleets& fleets, int owner) {
+	const int* owners = Data(fleets.owner);
+	const int* ships = Data(fleets.numShips);
+	const size_t n = fleets.size();
+	size_t i = 0;
+	int sum = 0;
+#ifdef PW_SIMD_WIDTH
+	const SimdInt vowner = SimdSet(owner);
+	SimdInt vsum = SimdSet(0);
+	for (; i + PW_SIMD_WIDTH <= n; i += PW_SIMD_WIDTH)
+		vsum = SimdAdd(vsum, SimdAnd(SimdCmpEq(SimdLoad(owners + i), vowner), SimdLoad(ships + i)));
+	sum = SimdHorizontalSum(vsum);
+#endif
+	for (; i < n; ++i) {
+		if (owners[i] == owner)
+			sum += ships[i];
+	}
+	return sum;
+}
+
+bool FleetsHaveOwner(const Fleets& fleets, int owner) {
+	const int* owners = Data(fleets.owner);
+	const size_t n = fleets.size();
+	size_t i = 0;
+#ifdef PW_SIMD_WIDTH
+	const SimdInt vowner = SimdSet(owner);
+	for (; i + PW_SIMD_WIDTH <= n; i += PW_SIMD_WIDTH) {
+		if (SimdMask(SimdCmpEq(SimdLoad(owners + i), vowner)))
+			return true;
+	}
+#endif
+	for (; i < n; ++i) {
+		if (owners[i] == owner)
+			return true;
+	}
+	return false;
+}
+
+int FleetsHighestOwner(const Fleets& fleets) {
+	const int* owners = Data(fleets.owner);
+	const size_t n = fleets.size();
+	size_t i = 0;
+	int highest = 0;
+#ifdef PW_SIMD_WIDTH
+	SimdInt vhighest = SimdSet(0);
+	for (; i + PW_SIMD_WIDTH <= n; i += PW_SIMD_WIDTH)
+		vhighest = SimdMax(vhighest, SimdLoad(owners + i));
+	highest = SimdHorizontalMax(vhighest);
+#endif
+	for (; i < n; ++i)
+		highest = std::max(highest, owners[i]);
+	return highest;
+}
+
+// Sets the number of ships and owner of the planet according the outcome
+// of the battle. ships[i] is the number of ships of owner i.
+static inline void ResolveBattle(PlanetState& p, const int* ships, size_t numOwners) {
 	Fleet winner(0, 0);
 	Fleet second(0, 0);
-	for (size_t i = 0;
-#ifdef ONLY2PLAYERS
-		 i < 3;
-#else
-		 i < participants.size();
-#endif
-		 ++i) {
-		if (participants[i] > second.numShips) {
-			if(participants[i] > winner.numShips) {
+	for (size_t i = 0; i < numOwners; ++i) {
+		if (ships[i] > second.numShips) {
+			if(ships[i] > winner.numShips) {
 				second = winner;
-				winner = Fleet(i, participants[i]);
+				winner = Fleet(i, ships[i]);
 			} else {
-				second = Fleet(i, participants[i]);
+				second = Fleet(i, ships[i]);
 			}
 		}
 	}
@@ -116,21 +467,556 @@ void PlanetState::FightBattle(int myPlanetIndex, const std::vector<Fleet>& fleet
 	}
 }
 
+// Sums up the ships of all participants of a battle, indexed by owner.
+template<int MaxPlayers>
+struct BattleParticipants {
+	int ships[MaxPlayers + 1];
+	BattleParticipants(const PlanetState& p) {
+		std::fill(ships, ships + MaxPlayers + 1, 0);
+		ships[p.owner] = p.numShips;
+	}
+	void Add(int owner, int numShips) { ships[owner] += numShips; }
+	void Resolve(PlanetState& p) const { ResolveBattle(p, ships, MaxPlayers + 1); }
+};
+
+// Any number of players. Only allocates with really many players.
+template<>
+struct BattleParticipants<DynamicPlayers> {
+	enum { InlineSize = 16 };
+	int inlineShips[InlineSize];
+	std::vector<int> moreShips;
+	int* ships;
+	size_t size;
+	
+	BattleParticipants(const PlanetState& p) : ships(inlineShips), size(0) {
+		Grow( std::max(3, p.owner + 1) );
+		ships[p.owner] = p.numShips;
+	}
+	void Grow(size_t newSize) {
+		if (newSize <= size) return;
+		if (newSize > InlineSize) {
+			if (ships == inlineShips) moreShips.assign(inlineShips, inlineShips + size);
+			moreShips.resize(newSize, 0);
+			ships = &moreShips[0];
+		}
+		else
+			std::fill(ships + size, ships + newSize, 0);
+		size = newSize;
+	}
+	void Add(int owner, int numShips) {
+		Grow((size_t)owner + 1);
+		ships[owner] += numShips;
+	}
+	void Resolve(PlanetState& p) const { ResolveBattle(p, ships, size); }
+	
+private:
+	BattleParticipants(const BattleParticipants&);
+	BattleParticipants& operator=(const BattleParticipants&);
+};
+
+//Resolves the battle at planet p, if there is one.
+//* Removes all fleets involved in the battle
+//* Sets the number of ships and owner of the planet according the outcome
+template<int MaxPlayers>
+void PlanetState::FightBattle(int myPlanetIndex, const Fleets& fleets, int dt) {
+	BattleParticipants<MaxPlayers> participants(*this);
+	for (size_t i = 0; i < fleets.size(); ++i) {
+		if (fleets.turnsRemaining[i] == dt && fleets.destinationPlanet[i] == myPlanetIndex)
+			participants.Add(fleets.owner[i], fleets.numShips[i]);
+	}
+	participants.Resolve(*this);
+}
+
+template<int MaxPlayers>
+void PlanetState::FightBattle(int myPlanetIndex, const Fleets& fleets, const FleetArrivals& arrivals, int dt) {
+	BattleParticipants<MaxPlayers> participants(*this);
+	const int *f, *fEnd;
+	arrivals.Arriving(fleets, myPlanetIndex, dt, f, fEnd);
+	for (; f != fEnd; ++f)
+		participants.Add(fleets.owner[*f], fleets.numShips[*f]);
+	participants.Resolve(*this);
+}
+
+// We sort by turnsRemaining. All invalid negative values are put together
+// in front of 0 so that FleetsTimeStep (which sets them to 0) keeps the order.
+static inline unsigned int ArrivalKey(int turnsRemaining) { return (unsigned int)std::max(turnsRemaining, -1) + 1; }
+
+struct ArrivalKeyLess {
+	const int* turns;
+	ArrivalKeyLess(const int* _turns) : turns(_turns) {}
+	bool operator()(int a, int b) const { return ArrivalKey(turns[a]) < ArrivalKey(turns[b]); }
+};
+
+void FleetArrivals::Build(const Fleets& fleets, size_t numPlanets) {
+	numFleets = fleets.size();
+	generation = fleets.generation;
+	const int* dest = fleets.destinationPlanet.empty() ? NULL : &fleets.destinationPlanet[0];
+	const int* turns = fleets.turnsRemaining.empty() ? NULL : &fleets.turnsRemaining[0];
+	
+	// Counting sort by turnsRemaining. Fleets which will never arrive
+	// anywhere are left out.
+	planetBegin.assign(numPlanets + 1, 0);
+	unsigned int maxKey = 0;
+	size_t n = 0;
+	for (size_t i = 0; i < numFleets; ++i) {
+		if (dest[i] < 0 || (size_t)dest[i] >= numPlanets) continue;
+		maxKey = std::max(maxKey, ArrivalKey(turns[i]));
+		++planetBegin[dest[i] + 1];
+		++n;
+	}
+	if (maxKey > 4 * n + 256) {
+		// Huge trip times (only in hand-made states): a counting sort would
+		// need too much memory.
+		scratchOrder.clear();
+		for (size_t i = 0; i < numFleets; ++i) {
+			if (dest[i] < 0 || (size_t)dest[i] >= numPlanets) continue;
+			scratchOrder.push_back(i);
+		}
+		std::stable_sort(scratchOrder.begin(), scratchOrder.end(), ArrivalKeyLess(turns));
+	}
+	else {
+		scratchCounts.assign(maxKey + 2, 0);
+		for (size_t i = 0; i < numFleets; ++i) {
+			if (dest[i] < 0 || (size_t)dest[i] >= numPlanets) continue;
+			++scratchCounts[ArrivalKey(turns[i]) + 1];
+		}
+		for (size_t k = 1; k < scratchCounts.size(); ++k)
+			scratchCounts[k] += scratchCounts[k - 1];
+		scratchOrder.resize(n);
+		for (size_t i = 0; i < numFleets; ++i) {
+			if (dest[i] < 0 || (size_t)dest[i] >= numPlanets) continue;
+			scratchOrder[scratchCounts[ArrivalKey(turns[i])]++] = i;
+		}
+	}
+	
+	// Stable counting sort by destination. planetBegin[p] is used as the
+	// insert position for planet p and is restored afterwards.
+	for (size_t p = 1; p < planetBegin.size(); ++p)
+		planetBegin[p] += planetBegin[p - 1];
+	fleetIds.resize(n);
+	for (size_t i = 0; i < n; ++i)
+		fleetIds[planetBegin[dest[scratchOrder[i]]]++] = scratchOrder[i];
+	for (size_t p = numPlanets; p > 0; --p)
+		planetBegin[p] = planetBegin[p - 1];
+	planetBegin[0] = 0;
+}
+
+const std::vector<int>& FleetArrivals::RemoveFinal(const Fleets& fleets) {
+	// RemoveFinalFleets keeps the order, so the new index is the number of
+	// staying fleets before.
+	const int* turns = Data(fleets.turnsRemaining);
+	std::vector<int>& newIds = scratchOrder;
+	newIds.resize(fleets.size());
+	int numLeft = 0;
+	for (size_t i = 0; i < fleets.size(); ++i)
+		newIds[i] = (turns[i] > 0) ? numLeft++ : -1;
+	
+	// The removed fleets are at the front of each bucket.
+	const size_t numPlanets = planetBegin.size() - 1;
+	int n = 0;
+	for (size_t p = 0; p < numPlanets; ++p) {
+		const int end = planetBegin[p + 1];
+		int i = planetBegin[p];
+		while (i < end && turns[fleetIds[i]] <= 0) ++i;
+		planetBegin[p] = n;
+		for (; i < end; ++i)
+			fleetIds[n++] = newIds[fleetIds[i]];
+	}
+	planetBegin[numPlanets] = n;
+	fleetIds.resize(n);
+	return newIds;
+}
+
+struct TurnsRemainingLess {
+	const Fleets& fleets;
+	TurnsRemainingLess(const Fleets& _fleets) : fleets(_fleets) {}
+	bool operator()(int fleetId, int turns) const { return fleets.turnsRemaining[fleetId] < turns; }
+};
+
+void FleetArrivals::Arriving(const Fleets& fleets, int planet, int dt, const int*& begin, const int*& end) const {
+	begin = end = NULL;
+	if (planet < 0 || (size_t)planet + 1 >= planetBegin.size() || fleetIds.empty()) return;
+	const int* first = &fleetIds[0] + planetBegin[planet];
+	const int* last = &fleetIds[0] + planetBegin[planet + 1];
+	begin = end = std::lower_bound(first, last, dt, TurnsRemainingLess(fleets));
+	while (end != last && fleets.turnsRemaining[*end] == dt) ++end;
+}
+
+static inline size_t FleetKeyHash(int owner, int sourcePlanet, int destinationPlanet, int turnsRemaining) {
+	unsigned int h = (unsigned int)owner * 0x9E3779B1u;
+	h = (h ^ (unsigned int)sourcePlanet) * 0x85EBCA77u;
+	h = (h ^ (unsigned int)destinationPlanet) * 0xC2B2AE3Du;
+	h = (h ^ (unsigned int)turnsRemaining) * 0x27D4EB2Fu;
+	return h ^ (h >> 15);
+}
+
+static inline bool FleetHasKey(const Fleets& fleets, int i, int owner, int sourcePlanet, int destinationPlanet, int turnsRemaining) {
+	return fleets.owner[i] == owner &&
+		fleets.sourcePlanet[i] == sourcePlanet &&
+		fleets.destinationPlanet[i] == destinationPlanet &&
+		fleets.turnsRemaining[i] == turnsRemaining;
+}
+
+static const int FleetIndexEmpty = -1;
+static const int FleetIndexRemoved = -2;
+
+// Inserts fleet i if there is no fleet with the same key yet. The slot of a
+// removed fleet is reused.
+static inline void FleetIndexInsert(std::vector<int>& slots, size_t& numKeys, const Fleets& fleets, int i, int turnsPassed) {
+	const size_t mask = slots.size() - 1;
+	const int owner = fleets.owner[i], source = fleets.sourcePlanet[i];
+	const int dest = fleets.destinationPlanet[i], turns = fleets.turnsRemaining[i];
+	size_t removedSlot = slots.size();
+	for (size_t s = FleetKeyHash(owner, source, dest, turns + turnsPassed) & mask; ; s = (s + 1) & mask) {
+		if (slots[s] == FleetIndexEmpty) {
+			if (removedSlot != slots.size()) s = removedSlot;
+			else ++numKeys;
+			slots[s] = i;
+			return;
+		}
+		if (slots[s] == FleetIndexRemoved) {
+			if (removedSlot == slots.size()) removedSlot = s;
+		}
+		else if (FleetHasKey(fleets, slots[s], owner, source, dest, turns))
+			return;
+	}
+}
+
+// We keep the load factor below 1/2.
+static inline size_t FleetIndexSize(size_t numKeys) {
+	size_t size = 16;
+	while (size < 2 * numKeys) size *= 2;
+	return size;
+}
+
+void FleetIndex::Build(const Fleets& fleets) {
+	numFleets = fleets.size();
+	generation = fleets.generation;
+	numKeys = 0;
+	turnsPassed = 0;
+	slots.assign(FleetIndexSize(numFleets + 1), FleetIndexEmpty);
+	for (size_t i = 0; i < numFleets; ++i)
+		FleetIndexInsert(slots, numKeys, fleets, i, turnsPassed);
+}
+
+int FleetIndex::Find(const Fleets& fleets, int owner, int sourcePlanet, int destinationPlanet, int turnsRemaining) const {
+	const size_t mask = slots.size() - 1;
+	for (size_t s = FleetKeyHash(owner, sourcePlanet, destinationPlanet, turnsRemaining + turnsPassed) & mask; ; s = (s + 1) & mask) {
+		if (slots[s] == FleetIndexEmpty)
+			return -1;
+		if (slots[s] != FleetIndexRemoved &&
+			FleetHasKey(fleets, slots[s], owner, sourcePlanet, destinationPlanet, turnsRemaining))
+			return slots[s];
+	}
+}
+
+void FleetIndex::AddLast(const Fleets& fleets) {
+	if (2 * (numKeys + 1) > slots.size()) {
+		Build(fleets);
+		return;
+	}
+	numFleets = fleets.size();
+	generation = fleets.generation;
+	FleetIndexInsert(slots, numKeys, fleets, numFleets - 1, turnsPassed);
+}
+
+void FleetIndex::RemoveFinal(const std::vector<int>& newIds) {
+	for (size_t s = 0; s < slots.size(); ++s) {
+		if (slots[s] >= 0) {
+			const int i = newIds[slots[s]];
+			slots[s] = (i >= 0) ? i : FleetIndexRemoved;
+		}
+	}
+}
+
+// Moves the planet in the stats from before.owner to after.owner.
+static inline void PlanetStatsChanged(std::vector<GameState::PlayerStats>& stats,
+									  const PlanetState& before, const PlanetState& after,
+									  int growthRate) {
+	if (before.owner == after.owner) {
+		stats[after.owner].shipsOnPlanets += after.numShips - before.numShips;
+		return;
+	}
+	GameState::PlayerStats& oldOwner = stats[before.owner];
+	--oldOwner.numPlanets;
+	oldOwner.shipsOnPlanets -= before.numShips;
+	oldOwner.production -= growthRate;
+	GameState::PlayerStats& newOwner = stats[after.owner];
+	++newOwner.numPlanets;
+	newOwner.shipsOnPlanets += after.numShips;
+	newOwner.production += growthRate;
+}
+
+void GameState::UpdateStats(const GameDesc& desc) {
+	statsValid = false;
+	for (Planets::const_iterator p = planets.begin(); p != planets.end(); ++p) {
+		if (p->owner < 0) return;
+	}
+	for (size_t i = 0; i < fleets.size(); ++i) {
+		if (fleets.owner[i] < 0) return;
+	}
+	
+	playerStats.assign(HighestPlayerIDScan() + 1, PlayerStats());
+	for (size_t p = 0; p < planets.size(); ++p) {
+		PlayerStats& stats = playerStats[planets[p].owner];
+		++stats.numPlanets;
+		stats.shipsOnPlanets += planets[p].numShips;
+		stats.production += desc.planets[p].growthRate;
+	}
+	for (size_t i = 0; i < fleets.size(); ++i) {
+		PlayerStats& stats = playerStats[fleets.owner[i]];
+		++stats.numFleets;
+		stats.shipsInFleets += fleets.numShips[i];
+	}
+	statsValid = true;
+}
+
+bool GameState::CheckStats(const GameDesc& desc) const {
+	if (!statsValid) return true;
+	if (HighestPlayerID() != HighestPlayerIDScan()) return false;
+	if (Winner(false) != WinnerScan(false) || Winner(true) != WinnerScan(true)) return false;
+	std::vector<int> numFleets(playerStats.size(), 0);
+	for (size_t i = 0; i < fleets.size(); ++i) {
+		if (fleets.owner[i] < 0 || (size_t)fleets.owner[i] >= playerStats.size()) return false;
+		++numFleets[fleets.owner[i]];
+	}
+	for (int playerID = 0; (size_t)playerID < playerStats.size() + 1; ++playerID) {
+		if (IsAlive(playerID) != IsAliveScan(playerID)) return false;
+		if (NumShips(playerID) != NumShipsScan(playerID)) return false;
+		if (NumShipsOnPlanets(playerID) != NumShipsOnPlanetsScan(playerID)) return false;
+		if (Production(playerID, desc) != ProductionScan(playerID, desc)) return false;
+		if ((size_t)playerID < playerStats.size() && playerStats[playerID].numFleets != numFleets[playerID]) return false;
+	}
+	return true;
+}
+
+// ---------------- Zobrist hash ----------------
+// The Zobrist keys are not stored in tables but computed by a 64-bit mixer,
+// as owners and ship counts are unbounded. The hash is the sum over all
+// owners of OwnerKey(owner) * (sum of the planet and fleet terms of owner).
+// A sum (instead of a xor) keeps equal fleets from cancelling each other.
+// The fleet terms are multiplied by FleetAgeKey^turnsRemaining, so one time
+// step just multiplies the fleet sums by the inverse of FleetAgeKey.
+
+typedef GameState::HashValue HashValue;
+
+static inline HashValue HashMix(HashValue x) {
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+// Exact up to 15 ships, then four buckets per doubling.
+static inline int ShipBucket(int numShips) {
+	if (numShips < 16) return numShips;
+	int e = 4;
+	while ((numShips >> (e + 1)) != 0) ++e;
+	return 16 + (e - 4) * 4 + ((numShips >> (e - 2)) & 3);
+}
+
+static const HashValue FleetAgeKey = 0x9E3779B97F4A7C15ULL;
+
+// Inverse of an odd number modulo 2^64 by Newton's iteration.
+static HashValue HashInverse(HashValue a) {
+	HashValue x = a;
+	for (int i = 0; i < 6; ++i) x *= 2 - a * x;
+	return x;
+}
+
+static const HashValue FleetAgeKeyInverse = HashInverse(FleetAgeKey);
+
+static HashValue HashPower(HashValue a, int n) {
+	HashValue r = 1;
+	for (; n > 0; n >>= 1, a *= a)
+		if (n & 1) r *= a;
+	return r;
+}
+
+static inline HashValue OwnerKey(int owner) {
+	return HashMix(0x5851F42D4C957F2DULL + (HashValue)owner) | 1;
+}
+
+static inline HashValue PlanetHashTerm(int planet, int numShips) {
+	return HashMix(HashMix(0x2545F4914F6CDD1DULL + (HashValue)planet) + (HashValue)ShipBucket(numShips));
+}
+
+static inline HashValue FleetHashTerm(const Fleets& fleets, int i) {
+	HashValue h = HashMix(0x14057B7EF767814FULL + (HashValue)fleets.sourcePlanet[i]);
+	h = HashMix(h + (HashValue)fleets.destinationPlanet[i]);
+	h = HashMix(h + (HashValue)ShipBucket(fleets.numShips[i]));
+	return h * HashPower(FleetAgeKey, fleets.turnsRemaining[i]);
+}
+
+static inline void PlanetHashChanged(std::vector<GameState::HashTerms>& terms, int p,
+									 const PlanetState& before, const PlanetState& after) {
+	if (before.owner == after.owner && ShipBucket(before.numShips) == ShipBucket(after.numShips))
+		return;
+	terms[before.owner].planets -= PlanetHashTerm(p, before.numShips);
+	terms[after.owner].planets += PlanetHashTerm(p, after.numShips);
+}
+
+// Returns false if there are invalid owners.
+static bool ComputeHashTerms(const GameState& state, std::vector<GameState::HashTerms>& terms) {
+	int highestOwner = 0;
+	for (size_t p = 0; p < state.planets.size(); ++p) {
+		if (state.planets[p].owner < 0) return false;
+		highestOwner = std::max(highestOwner, state.planets[p].owner);
+	}
+	for (size_t i = 0; i < state.fleets.size(); ++i) {
+		if (state.fleets.owner[i] < 0) return false;
+		highestOwner = std::max(highestOwner, state.fleets.owner[i]);
+	}
+	terms.assign(highestOwner + 1, GameState::HashTerms());
+	for (size_t p = 0; p < state.planets.size(); ++p)
+		terms[state.planets[p].owner].planets += PlanetHashTerm(p, state.planets[p].numShips);
+	for (size_t i = 0; i < state.fleets.size(); ++i)
+		terms[state.fleets.owner[i]].fleets += FleetHashTerm(state.fleets, i);
+	return true;
+}
+
+static HashValue CombineHashTerms(const std::vector<GameState::HashTerms>& terms, int pov) {
+	HashValue h = 0;
+	for (size_t owner = 0; owner < terms.size(); ++owner)
+		h += OwnerKey(Game::PovSwitch(pov, owner)) * (terms[owner].planets + terms[owner].fleets);
+	return h;
+}
+
+void GameState::UpdateHash() {
+	hashValid = ComputeHashTerms(*this, hashTerms);
+}
+
+GameState::HashValue GameState::Hash(int pov) const {
+	if (!hashValid) return HashScan(pov);
+	return CombineHashTerms(hashTerms, pov);
+}
+
+GameState::HashValue GameState::HashScan(int pov) const {
+	std::vector<HashTerms> terms;
+	ComputeHashTerms(*this, terms);
+	return CombineHashTerms(terms, pov);
+}
+
 // Executes one time step.
 //   * Planet bonuses are added to non-neutral planets.
 //   * Fleets are advanced towards their destinations.
 //   * Fleets that arrive at their destination are dealt with.
-void GameState::DoTimeStep(const GameDesc& desc) {
+template<int MaxPlayers>
+void GameState::DoTimeStep(const GameDesc& desc, GameStateUndo* undo) {
+	if (undo) {
+		undo->BeginStep(*this, true);
+		// Exactly these fleets will be removed at the end of this step.
+		for (size_t i = 0; i < fleets.size(); ++i) {
+			if (fleets.turnsRemaining[i] > 1) continue;
+			undo->fleets.push_back(GameStateUndo::FleetEntry(i, fleets[i]));
+		}
+	}
+	UpdateArrivals(); // the time step itself keeps it valid, see below
+	const bool haveFleetIndex = HaveFleetIndex(); // also kept, if we have it
+	
+	// Take the fleets which arrive in this step out of the hash, then age the others.
+	size_t numHashRemoved = 0;
+	if (hashValid) {
+		for (size_t p = 0; p < planets.size(); ++p) {
+			for (int dt = 0; dt <= 1; ++dt) {
+				const int *f, *fEnd;
+				arrivals.Arriving(fleets, p, dt, f, fEnd);
+				for (; f != fEnd; ++f, ++numHashRemoved)
+					hashTerms[fleets.owner[*f]].fleets -= FleetHashTerm(fleets, *f);
+			}
+		}
+		for (size_t owner = 0; owner < hashTerms.size(); ++owner)
+			hashTerms[owner].fleets *= FleetAgeKeyInverse;
+	}
 	FleetsTimeStep(fleets);
+	if (haveFleetIndex) fleetIndex.TimeSteps(1);
 	
-	for (size_t p = 0; p < planets.size(); ++p)
-		planets[p].DoTimeStep(p, desc.planets[p].growthRate, fleets);
+	for (size_t p = 0; p < planets.size(); ++p) {
+		PlanetState& planet = planets[p];
+		const PlanetState before = planet;
+		if (planet.owner > 0) planet.numShips += desc.planets[p].growthRate;
+		planet.FightBattle<MaxPlayers>(p, fleets, arrivals);
+		if (statsValid) PlanetStatsChanged(playerStats, before, planet, desc.planets[p].growthRate);
+		if (hashValid) PlanetHashChanged(hashTerms, p, before, planet);
+		if (undo && (before.owner != planet.owner || before.numShips != planet.numShips)) {
+			GameStateUndo::PlanetEntry e;
+			e.planet = p;
+			e.before = before;
+			undo->planets.push_back(e);
+		}
+	}
 	
+	// All fleets which arrived now are removed.
+	size_t numArrived = 0;
+	if (statsValid) {
+		for (size_t p = 0; p < planets.size(); ++p) {
+			const int *f, *fEnd;
+			arrivals.Arriving(fleets, p, 0, f, fEnd);
+			for (; f != fEnd; ++f, ++numArrived) {
+				PlayerStats& stats = playerStats[fleets.owner[*f]];
+				--stats.numFleets;
+				stats.shipsInFleets -= fleets.numShips[*f];
+			}
+		}
+	}
+	const size_t numFleets = fleets.size();
+	const std::vector<int>& newIds = arrivals.RemoveFinal(fleets);
+	if (haveFleetIndex) fleetIndex.RemoveFinal(newIds);
 	RemoveFinalFleets(fleets);
+	arrivals.Revalidate(fleets);
+	if (haveFleetIndex) fleetIndex.Revalidate(fleets);
+	// Fleets without a valid destination are not in the arrivals index.
+	if (statsValid && numFleets - fleets.size() != numArrived)
+		UpdateStats(desc);
+	if (hashValid && numFleets - fleets.size() != numHashRemoved)
+		UpdateHash();
+	CHECK_STATS(desc);
+}
+
+int GameState::NextArrival() const {
+	int next = std::numeric_limits<int>::max();
+	for (size_t i = 0; i < fleets.size(); ++i) {
+		if (fleets.turnsRemaining[i] < next)
+			next = fleets.turnsRemaining[i];
+	}
+	return std::max(next, 1);
 }
 
+template<int MaxPlayers>
+void GameState::DoTimeSteps(int n, const GameDesc& desc) {
+	while (n > 0) {
+		// Nothing but planet growth happens until the next fleet arrives.
+		int quietSteps = std::min(n, NextArrival() - 1);
+		if (quietSteps > 0) {
+			const bool haveArrivals = HaveArrivals(), haveFleetIndex = HaveFleetIndex();
+			FleetsTimeSteps(fleets, quietSteps); // keeps the indices valid
+			if (haveArrivals) arrivals.Revalidate(fleets);
+			if (haveFleetIndex) {
+				fleetIndex.TimeSteps(quietSteps);
+				fleetIndex.Revalidate(fleets);
+			}
+			if (hashValid) {
+				const HashValue age = HashPower(FleetAgeKeyInverse, quietSteps);
+				for (size_t owner = 0; owner < hashTerms.size(); ++owner)
+					hashTerms[owner].fleets *= age;
+			}
+			for (size_t p = 0; p < planets.size(); ++p) {
+				const PlanetState before = planets[p];
+				planets[p].DoQuietTimeSteps(desc.planets[p].growthRate, quietSteps);
+				if (statsValid)
+					playerStats[planets[p].owner].shipsOnPlanets += planets[p].numShips - before.numShips;
+				if (hashValid) PlanetHashChanged(hashTerms, p, before, planets[p]);
+			}
+			n -= quietSteps;
+			if (n == 0) break;
+		}
+		DoTimeStep<MaxPlayers>(desc);
+		--n;
+	}
+}
+
+template<int MaxPlayers>
 void Game::DoTimeStep() {
-	state.DoTimeStep(desc);
+	state.DoTimeStep<MaxPlayers>(desc);
 	
 	if(gamePlayback) {
 		bool needcomma = false;
@@ -158,16 +1044,38 @@ void Game::DoTimeStep() {
 	++numTurns;	
 }
 
+#define INSTANTIATE_FOR_MAXPLAYERS(MaxPlayers) \
+	template void PlanetState::FightBattle<MaxPlayers>(int, const Fleets&, int); \
+	template void PlanetState::FightBattle<MaxPlayers>(int, const Fleets&, const FleetArrivals&, int); \
+	template void GameState::DoTimeStep<MaxPlayers>(const GameDesc&, GameStateUndo*); \
+	template void GameState::DoTimeSteps<MaxPlayers>(int, const GameDesc&); \
+	template void Game::DoTimeStep<MaxPlayers>();
+INSTANTIATE_FOR_MAXPLAYERS(2)
+INSTANTIATE_FOR_MAXPLAYERS(4)
+INSTANTIATE_FOR_MAXPLAYERS(8)
+INSTANTIATE_FOR_MAXPLAYERS(DynamicPlayers)
+#undef INSTANTIATE_FOR_MAXPLAYERS
+
+int Game::MaxPlayersFor(int numPlayers) const {
+	int n = std::max(numPlayers, state.HighestPlayerID());
+	if (n <= 2) return 2;
+	if (n <= 4) return 4;
+	if (n <= 8) return 8;
+	return DynamicPlayers;
+}
 
-Fleet* GameState::MatchingExistingFleet(const Fleet& f) {
-	for (Fleets::iterator fi = fleets.begin(); fi != fleets.end(); ++fi) {
-		if (fi->owner == f.owner &&
-			fi->sourcePlanet == f.sourcePlanet &&
-			fi->destinationPlanet == f.destinationPlanet &&
-			fi->turnsRemaining == f.turnsRemaining)
-			return &*fi;
+
+int GameState::MatchingExistingFleet(const Fleet& f) const {
+	if (HaveFleetIndex())
+		return fleetIndex.Find(fleets, f.owner, f.sourcePlanet, f.destinationPlanet, f.turnsRemaining);
+	for (size_t i = 0; i < fleets.size(); ++i) {
+		if (fleets.owner[i] == f.owner &&
+			fleets.sourcePlanet[i] == f.sourcePlanet &&
+			fleets.destinationPlanet[i] == f.destinationPlanet &&
+			fleets.turnsRemaining[i] == f.turnsRemaining)
+			return i;
 	}
-	return NULL;
+	return -1;
 }
 
 
@@ -181,7 +1089,8 @@ bool GameState::ExecuteOrder(const GameDesc& desc,
 							 int playerID,
 							 int sourcePlanet,
 							 int destinationPlanet,
-							 int numShips) {
+							 int numShips,
+							 GameStateUndo* undo) {
 	if (numShips <= 0 ||
 		sourcePlanet < 0 || planets.size() <= (Planets::size_type)sourcePlanet ||
 		destinationPlanet < 0 || planets.size() <= (Planets::size_type)destinationPlanet ||
@@ -202,10 +1111,126 @@ bool GameState::ExecuteOrder(const GameDesc& desc,
 			destinationPlanet,
 			distance,
 			distance);
-	if(Fleet* existingFleet = MatchingExistingFleet(f))
-		existingFleet->numShips += numShips;
-	else 
+	UpdateFleetIndex();
+	int existingFleet = MatchingExistingFleet(f);
+	if (hashValid) {
+		PlanetState before = source;
+		before.numShips += numShips;
+		PlanetHashChanged(hashTerms, sourcePlanet, before, source);
+		if (existingFleet >= 0)
+			hashTerms[playerID].fleets -= FleetHashTerm(fleets, existingFleet);
+	}
+	if(existingFleet >= 0)
+		fleets.numShips[existingFleet] += numShips;
+	else {
 		fleets.push_back(f);
+		fleetIndex.AddLast(fleets);
+		InvalidateArrivals();
+	}
+	if (hashValid)
+		hashTerms[playerID].fleets += FleetHashTerm(fleets, existingFleet >= 0 ? existingFleet : (int)fleets.size() - 1);
+	if (statsValid) {
+		PlayerStats& stats = playerStats[playerID];
+		stats.shipsOnPlanets -= numShips;
+		stats.shipsInFleets += numShips;
+		if (existingFleet < 0) ++stats.numFleets;
+	}
+	if (undo) {
+		GameStateUndo::OrderEntry e;
+		e.sourcePlanet = sourcePlanet;
+		e.numShips = numShips;
+		e.fleetId = (existingFleet >= 0) ? existingFleet : (int)fleets.size() - 1;
+		e.newFleet = existingFleet < 0;
+		undo->orders.push_back(e);
+	}
+	CHECK_STATS(desc);
+	return true;
+}
+
+bool GameState::ApplyOrders(const GameDesc& desc,
+							int playerID,
+							const std::vector<Order>& orders,
+							GameStateUndo& undo) {
+	undo.BeginStep(*this, false);
+	bool allValid = true;
+	for (size_t i = 0; i < orders.size(); ++i) {
+		const Order& o = orders[i];
+		if (!ExecuteOrder(desc, playerID, o.sourcePlanet, o.destinationPlanet, o.numShips, &undo))
+			allValid = false;
+	}
+	return allValid;
+}
+
+void GameStateUndo::BeginStep(const GameState& state, bool isTimeStep) {
+	Step step;
+	step.isTimeStep = isTimeStep;
+	step.statsValid = state.statsValid;
+	step.ordersBegin = orders.size();
+	step.planetsBegin = planets.size();
+	step.fleetsBegin = fleets.size();
+	step.statsBegin = stats.size();
+	if (state.statsValid)
+		stats.insert(stats.end(), state.playerStats.begin(), state.playerStats.end());
+	step.hashValid = state.hashValid;
+	step.hashBegin = hashTerms.size();
+	if (state.hashValid)
+		hashTerms.insert(hashTerms.end(), state.hashTerms.begin(), state.hashTerms.end());
+	steps.push_back(step);
+}
+
+bool GameState::Undo(GameStateUndo& undo) {
+	if (undo.empty()) return false;
+	const GameStateUndo::Step& step = undo.steps.back();
+	
+	// Orders are reverted in reverse order, so new fleets are always the last ones.
+	for (size_t i = undo.orders.size(); i > step.ordersBegin; --i) {
+		const GameStateUndo::OrderEntry& e = undo.orders[i - 1];
+		if (e.newFleet)
+			fleets.pop_back();
+		else
+			fleets.numShips[e.fleetId] -= e.numShips;
+		planets[e.sourcePlanet].numShips += e.numShips;
+	}
+	
+	for (size_t i = undo.planets.size(); i > step.planetsBegin; --i) {
+		const GameStateUndo::PlanetEntry& e = undo.planets[i - 1];
+		planets[e.planet] = e.before;
+	}
+	
+	if (step.isTimeStep) {
+		// All remaining fleets were aged by exactly one turn.
+		for (size_t i = 0; i < fleets.size(); ++i)
+			++fleets.turnsRemaining[i];
+		// Put the removed fleets back at their old positions.
+		size_t src = fleets.size();
+		size_t dst = src + (undo.fleets.size() - step.fleetsBegin);
+		fleets.resize(dst);
+		for (size_t i = undo.fleets.size(); i > step.fleetsBegin; --i) {
+			const GameStateUndo::FleetEntry& e = undo.fleets[i - 1];
+			while (dst - 1 > (size_t)e.fleetId) {
+				--src; --dst;
+				fleets[dst] = fleets[src];
+			}
+			--dst;
+			fleets[dst] = e.before;
+		}
+	}
+	
+	statsValid = step.statsValid;
+	if (statsValid)
+		playerStats.assign(undo.stats.begin() + step.statsBegin, undo.stats.end());
+	hashValid = step.hashValid;
+	if (hashValid)
+		hashTerms.assign(undo.hashTerms.begin() + step.hashBegin, undo.hashTerms.end());
+	InvalidateArrivals();
+	InvalidateFleetIndex();
+	
+	undo.orders.erase(undo.orders.begin() + step.ordersBegin, undo.orders.end());
+	undo.planets.erase(undo.planets.begin() + step.planetsBegin, undo.planets.end());
+	undo.fleets.erase(undo.fleets.begin() + step.fleetsBegin, undo.fleets.end());
+	undo.stats.erase(undo.stats.begin() + step.statsBegin, undo.stats.end());
+	undo.hashTerms.erase(undo.hashTerms.begin() + step.hashBegin, undo.hashTerms.end());
+	undo.steps.pop_back();
 	return true;
 }
 
@@ -219,12 +1244,20 @@ bool Game::ExecuteOrder(int playerID, const std::string& order) {
 	int destinationPlanet = atoi(tokens[1].c_str());
 	int numShips = atoi(tokens[2].c_str());
 
-	if(!state.ExecuteOrder(desc, playerID, sourcePlanet, destinationPlanet, numShips)) {
+	return ExecuteOrder(playerID, Order(sourcePlanet, destinationPlanet, numShips));
+}
+
+bool Game::ExecuteOrder(int playerID, const Order& order) {
+	const int sourcePlanet = order.sourcePlanet;
+	const int numShips = order.numShips;
+	if(!state.ExecuteOrder(desc, playerID, sourcePlanet, order.destinationPlanet, numShips)) {
+		const bool validSource = sourcePlanet >= 0 && (size_t)sourcePlanet < state.planets.size();
 		WriteLogMessage("Dropping player " + to_string(playerID) +
-						". source.Owner() = " + to_string(state.planets[sourcePlanet].owner) + ", playerID = " +
+						". source.Owner() = " + (validSource ? to_string(state.planets[sourcePlanet].owner) : "?") + ", playerID = " +
 						to_string(playerID) + ", numShips = " + to_string(numShips) +
-						", source.NumShips() = " + to_string(state.planets[sourcePlanet].numShips));
-		std::cerr << "Dropping player " << playerID << " because of invalid order: " << order << std::endl;
+						", source.NumShips() = " + (validSource ? to_string(state.planets[sourcePlanet].numShips) : "?"));
+		std::cerr << "Dropping player " << playerID << " because of invalid order: "
+		<< sourcePlanet << " " << order.destinationPlanet << " " << numShips << std::endl;
 		state.DropPlayer(playerID);
 		return false;
 	}
@@ -234,28 +1267,57 @@ bool Game::ExecuteOrder(int playerID, const std::string& order) {
 // Kicks a player out of the game. This is used in cases where a player
 // tries to give an illegal order or runs over the time limit.
 void GameState::DropPlayer(int playerID) {
+	const bool updateHash = hashValid && playerID > 0 && (size_t)playerID < hashTerms.size();
 	for (Planets::iterator p = planets.begin(); p != planets.end(); ++p) {
 		if (p->owner == playerID)
 			p->owner = 0;
 	}
-	for (Fleets::iterator f = fleets.begin(); f != fleets.end(); ++f) {
-		if (f->owner == playerID)
-			f->Kill();
+	for (size_t i = 0; i < fleets.size(); ++i) {
+		if (fleets.owner[i] == playerID) {
+			fleets[i].Kill();
+			if (updateHash) hashTerms[0].fleets += FleetHashTerm(fleets, i);
+		}
+	}
+	// The planet terms don't depend on the owner, so they can just be moved.
+	if (updateHash) {
+		hashTerms[0].planets += hashTerms[playerID].planets;
+		hashTerms[playerID] = HashTerms();
+	}
+	else if (hashValid && playerID == 0)
+		UpdateHash();
+	InvalidateArrivals();
+	InvalidateFleetIndex();
+	
+	// Everything goes to the neutral player, the fleets without any ships.
+	if (statsValid && playerID >= 0 && (size_t)playerID < playerStats.size()) {
+		PlayerStats& dropped = playerStats[playerID];
+		PlayerStats& neutral = playerStats[0];
+		if (playerID > 0) {
+			neutral.numPlanets += dropped.numPlanets;
+			neutral.shipsOnPlanets += dropped.shipsOnPlanets;
+			neutral.production += dropped.production;
+			neutral.numFleets += dropped.numFleets;
+			dropped = PlayerStats();
+		}
+		else
+			neutral.shipsInFleets = 0;
 	}
 }
 
 // Returns true if the named player owns at least one planet or fleet.
 // Otherwise, the player is deemed to be dead and false is returned.
 bool GameState::IsAlive(int playerID) const {
+	if (statsValid)
+		return playerID >= 0 && (size_t)playerID < playerStats.size() && playerStats[playerID].IsAlive();
+	return IsAliveScan(playerID);
+}
+
+bool GameState::IsAliveScan(int playerID) const {
 	for (Planets::const_iterator p = planets.begin(); p != planets.end(); ++p) {
 		if (p->owner == playerID)
 			return true;
 	}
-	for (Fleets::const_iterator f = fleets.begin(); f != fleets.end(); ++f) {
-		if (f->owner == playerID)
-			return true;
-	}
-	return false;
+	return FleetsHaveOwner(fleets, playerID);
 }
 
 // If the game is not yet over (ie: at least two players have planets or
@@ -263,12 +1325,42 @@ bool GameState::IsAlive(int playerID) const {
 // is left) then that player's number is returned. If there are no
 // remaining players, then the game is a draw and 0 is returned.
 int GameState::Winner(bool maxTurnsReached) const {
+	if (!statsValid) return WinnerScan(maxTurnsReached);
+	int numRemaining = 0;
+	int lastRemaining = 0;
+	int leadingPlayer = -1;
+	int mostShips = -1;
+	for (size_t playerID = 1; playerID < playerStats.size(); ++playerID) {
+		const PlayerStats& stats = playerStats[playerID];
+		if (!stats.IsAlive()) continue;
+		++numRemaining;
+		lastRemaining = playerID;
+		int numShips = stats.shipsOnPlanets + stats.shipsInFleets;
+		if (numShips == mostShips) {
+			leadingPlayer = 0;
+		} else if (numShips > mostShips) {
+			leadingPlayer = playerID;
+			mostShips = numShips;
+		}
+	}
+	if (maxTurnsReached)
+		return leadingPlayer;
+	switch (numRemaining) {
+		case 0:
+			return 0;
+		case 1:
+			return lastRemaining;
+	}
+	return -1;
+}
+
+int GameState::WinnerScan(bool maxTurnsReached) const {
 	std::set<int> remainingPlayers;
 	for (Planets::const_iterator p = planets.begin(); p != planets.end(); ++p) {
 		remainingPlayers.insert(p->owner);
 	}
-	for (Fleets::const_iterator f = fleets.begin(); f != fleets.end(); ++f) {
-		remainingPlayers.insert(f->owner);
+	for (size_t i = 0; i < fleets.size(); ++i) {
+		remainingPlayers.insert(fleets.owner[i]);
 	}
 	remainingPlayers.erase(0);
 	if (maxTurnsReached) {
@@ -276,7 +1368,7 @@ int GameState::Winner(bool maxTurnsReached) const {
 		int mostShips = -1;
 		for (std::set<int>::iterator p = remainingPlayers.begin(); p != remainingPlayers.end(); ++p) {
 			int playerID = *p;
-			int numShips = NumShips(playerID);
+			int numShips = NumShipsScan(playerID);
 			if (numShips == mostShips) {
 				leadingPlayer = 0;
 			} else if (numShips > mostShips) {
@@ -298,19 +1390,31 @@ int GameState::Winner(bool maxTurnsReached) const {
 // Returns the number of ships that the current player has, either located
 // on planets or in flight.
 int GameState::NumShips(int playerID) const {
+	if (statsValid) {
+		if (playerID < 0 || (size_t)playerID >= playerStats.size()) return 0;
+		return playerStats[playerID].shipsOnPlanets + playerStats[playerID].shipsInFleets;
+	}
+	return NumShipsScan(playerID);
+}
+
+int GameState::NumShipsScan(int playerID) const {
 	int numShips = 0;
 	for (Planets::const_iterator p = planets.begin(); p != planets.end(); ++p) {
 		if (p->owner == playerID)
 			numShips += p->numShips;
 	}
-	for (Fleets::const_iterator f = fleets.begin(); f != fleets.end(); ++f) {
-		if (f->owner == playerID)
-			numShips += f->numShips;
-	}
-	return numShips;
+	return numShips + FleetsNumShips(fleets, playerID);
 }
 
 int GameState::NumShipsOnPlanets(int playerID) const {
+	if (statsValid) {
+		if (playerID < 0 || (size_t)playerID >= playerStats.size()) return 0;
+		return playerStats[playerID].shipsOnPlanets;
+	}
+	return NumShipsOnPlanetsScan(playerID);
+}
+
+int GameState::NumShipsOnPlanetsScan(int playerID) const {
 	int numShips = 0;
 	for (Planets::const_iterator p = planets.begin(); p != planets.end(); ++p) {
 		if (p->owner == playerID)
@@ -321,60 +1425,194 @@ int GameState::NumShipsOnPlanets(int playerID) const {
 
 
 int GameState::HighestPlayerID() const {
+	if (statsValid) {
+		for (size_t playerID = playerStats.size() - 1; playerID > 0; --playerID) {
+			if (playerStats[playerID].IsAlive())
+				return playerID;
+		}
+		return 0;
+	}
+	return HighestPlayerIDScan();
+}
+
+int GameState::HighestPlayerIDScan() const {
 	int highestP = 0;
 	for (Planets::const_iterator p = planets.begin(); p != planets.end(); ++p) {
 		if (p->owner > highestP)
 			highestP = p->owner;
 	}
-	for (Fleets::const_iterator f = fleets.begin(); f != fleets.end(); ++f) {
-		if (f->owner > highestP)
-			highestP = f->owner;
+	return std::max(highestP, FleetsHighestOwner(fleets));
+}
+
+// ---------------- Point-in-Time parser ----------------
+// ParseGameState works directly on the input, without copying lines or
+// tokens. The number scanners behave exactly like atoi/atof on the token.
+
+static inline bool IsSpace(char c) { return isspace((unsigned char)c) != 0; }
+
+// Same as atoi, i.e. (int)strtol(token, NULL, 10).
+static int ScanInt(const char* p, const char* end) {
+	while (p != end && IsSpace(*p)) ++p;
+	bool negative = false;
+	if (p != end && (*p == '+' || *p == '-')) negative = (*p++ == '-');
+	unsigned long v = 0;
+	bool overflow = false;
+	for (; p != end && *p >= '0' && *p <= '9'; ++p) {
+		if (v > (ULONG_MAX - 9) / 10) overflow = true;
+		else v = v * 10 + (*p - '0');
+	}
+	long r;
+	if (negative) r = (overflow || v > (unsigned long)LONG_MAX) ? LONG_MIN : -(long)v;
+	else r = (overflow || v > (unsigned long)LONG_MAX) ? LONG_MAX : (long)v;
+	return (int)r;
+}
+
+// Same as atof. Plain decimals with at most 2^53 as mantissa and 22
+// fraction digits are exact as one division, which is what strtod gives.
+// Everything else (exponents, hex, inf, whitespace, ...) goes to atof.
+static double ScanDouble(const char* begin, const char* end) {
+	static const double powersOf10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	const unsigned long long maxMantissa = 1ULL << 53;
+	const char* p = begin;
+	bool negative = false;
+	if (p != end && (*p == '+' || *p == '-')) negative = (*p++ == '-');
+	unsigned long long mantissa = 0;
+	int numDigits = 0, fractionDigits = 0;
+	bool fast = true;
+	for (; p != end && *p >= '0' && *p <= '9'; ++p, ++numDigits) {
+		mantissa = mantissa * 10 + (*p - '0');
+		if (mantissa > maxMantissa) { fast = false; break; }
 	}
-	return highestP;	
+	if (fast && p != end && *p == '.') {
+		for (++p; p != end && *p >= '0' && *p <= '9'; ++p, ++numDigits, ++fractionDigits) {
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa > maxMantissa || fractionDigits >= 22) { fast = false; break; }
+		}
+	}
+	if (fast && numDigits > 0 && (p == end || (*p != 'e' && *p != 'E' && *p != 'x' && *p != 'X'))) {
+		double v = (double)mantissa / powersOf10[fractionDigits];
+		return negative ? -v : v;
+	}
+	
+	char buf[64];
+	const size_t len = end - begin;
+	if (len < sizeof(buf)) {
+		std::copy(begin, end, buf);
+		buf[len] = '\0';
+		return atof(buf);
+	}
+	return atof(std::string(begin, end).c_str());
 }
 
-// Parses a game state from a string. On success, returns true. On failure, returns false.
-bool Game::ParseGameState(const std::string& s) {
-	clear();
-	std::vector<std::string> lines = Tokenize(s, "\n");
-	for (size_t i = 0; i < lines.size(); ++i) {
-		std::string& line = lines[i];
-		size_t commentBegin = line.find('#');
-		if (commentBegin != std::string::npos)
-			line = line.substr(0, commentBegin);
-		if (TrimSpaces(line).size() == 0) continue;
+static inline bool TokenIs(const char* begin, const char* end, char c) {
+	return end - begin == 1 && *begin == c;
+}
+
+// Finds the next token in [c, end). Tokens are separated by spaces only.
+static inline bool NextToken(const char*& c, const char* end, const char*& tokenBegin, const char*& tokenEnd) {
+	while (c != end && *c == ' ') ++c;
+	if (c == end) return false;
+	tokenBegin = c;
+	while (c != end && *c != ' ') ++c;
+	tokenEnd = c;
+	return true;
+}
+
+// A non-blank line without its comment, split into tokens. We keep the
+// first MaxTokens tokens; numTokens counts all of them.
+struct ParsedLine {
+	enum { MaxTokens = 7 };
+	const char* begin;
+	const char* end;
+	const char* tokenBegin[MaxTokens];
+	const char* tokenEnd[MaxTokens];
+	size_t numTokens;
+	
+	bool TokenIs(size_t i, char c) const { return i < numTokens && ::TokenIs(tokenBegin[i], tokenEnd[i], c); }
+	int Int(size_t i) const { return ScanInt(tokenBegin[i], tokenEnd[i]); }
+	double Double(size_t i) const { return ScanDouble(tokenBegin[i], tokenEnd[i]); }
+};
+
+// Reads the next non-blank line from [p, end). Returns false at the end.
+static bool NextLine(const char*& p, const char* end, ParsedLine& line) {
+	while (p != end) {
+		line.begin = p;
+		line.end = (const char*)memchr(p, '\n', end - p);
+		if (!line.end) line.end = end;
+		p = (line.end == end) ? end : line.end + 1;
 		
-		std::vector<std::string> tokens = Tokenize(line, " ");
-		if (tokens.size() == 0) continue;
+		const char* commentBegin = (const char*)memchr(line.begin, '#', line.end - line.begin);
+		if (commentBegin) line.end = commentBegin;
+		bool empty = true;
+		for (const char* c = line.begin; c != line.end && empty; ++c)
+			if (!IsSpace(*c)) empty = false;
+		if (empty) continue;
 		
-		if (tokens[0] == "P") {
-			if (tokens.size() != 6) return 0;
+		line.numTokens = 0;
+		const char* c = line.begin;
+		const char *tokenBegin, *tokenEnd;
+		while (NextToken(c, line.end, tokenBegin, tokenEnd)) {
+			if (line.numTokens < ParsedLine::MaxTokens) {
+				line.tokenBegin[line.numTokens] = tokenBegin;
+				line.tokenEnd[line.numTokens] = tokenEnd;
+			}
+			++line.numTokens;
+		}
+		if (line.numTokens > 0) return true;
+	}
+	return false;
+}
+
+bool Game::ParseGameState(const std::string& s) {
+	// Bots get the same planets every turn. We overwrite them in place and
+	// rebuild the trip time table only if one of them moved.
+	state.clear();
+	if (desc.distanceSource) desc.distanceNumPlanets = 0; // not ours to keep
+	size_t numPlanets = 0;
+	bool ok = true;
+	const char* p = s.data();
+	const char* const end = p + s.size();
+	ParsedLine line;
+	while (NextLine(p, end, line)) {
+		const size_t numTokens = line.numTokens;
+		if (line.TokenIs(0, 'P')) {
+			if (numTokens != 6) { ok = false; break; }
 			
-			double x = atof(tokens[1].c_str());
-			double y = atof(tokens[2].c_str());
-			int owner = atoi(tokens[3].c_str());
-			int numShips = atoi(tokens[4].c_str());
-			int growthRate = atoi(tokens[5].c_str());
+			double x = line.Double(1);
+			double y = line.Double(2);
+			int owner = line.Int(3);
+			int numShips = line.Int(4);
+			int growthRate = line.Int(5);
 
 			if(gamePlayback) {
-				if (desc.planets.size() > 0) *gamePlayback << ":";
+				if (numPlanets > 0) *gamePlayback << ":";
 				*gamePlayback << x << "," << y << "," << owner << "," << numShips << "," << growthRate;				
 			}
 			
 			PlanetDesc planetDesc(growthRate, x, y);
 			PlanetState planetState(owner, numShips);
-			desc.planets.push_back(planetDesc);
+			if (numPlanets == desc.planets.size()) {
+				desc.planets.push_back(planetDesc);
+				desc.distanceNumPlanets = 0;
+			} else {
+				PlanetDesc& old = desc.planets[numPlanets];
+				if (!SameDouble(old.x, x) || !SameDouble(old.y, y)) desc.distanceNumPlanets = 0;
+				old = planetDesc;
+			}
+			++numPlanets;
 			state.planets.push_back(planetState);
 
-		} else if (tokens[0] == "F") {
-			if (tokens.size() != 7) return 0;
+		} else if (line.TokenIs(0, 'F')) {
+			if (numTokens != 7) { ok = false; break; }
 
-			int owner = atoi(tokens[1].c_str());
-			int numShips = atoi(tokens[2].c_str());
-			int source = atoi(tokens[3].c_str());
-			int destination = atoi(tokens[4].c_str());
-			int totalTripLength = atoi(tokens[5].c_str());
-			int turnsRemaining = atoi(tokens[6].c_str());
+			int owner = line.Int(1);
+			int numShips = line.Int(2);
+			int source = line.Int(3);
+			int destination = line.Int(4);
+			int totalTripLength = line.Int(5);
+			int turnsRemaining = line.Int(6);
 			
 			Fleet f(owner,
 					numShips,
@@ -384,13 +1622,107 @@ bool Game::ParseGameState(const std::string& s) {
 					turnsRemaining);
 			state.fleets.push_back(f);
 
-		} else
-			return false;
+		} else {
+			ok = false;
+			break;
+		}
 	}
+	desc.planets.erase(desc.planets.begin() + numPlanets, desc.planets.end());
+	if (!ok) return false;
+	if (!desc.HaveDistanceTable()) desc.BuildDistances();
+	state.UpdateArrivals();
 	if(gamePlayback) *gamePlayback << "|" << std::flush;
 	return true;
 }
 
+bool Game::IsDelta(const std::string& s) {
+	const char* p = s.data();
+	ParsedLine line;
+	return NextLine(p, p + s.size(), line) && line.numTokens == 1 && line.TokenIs(0, 'D');
+}
+
+bool Game::ApplyDelta(const std::string& s) {
+	const char* p = s.data();
+	const char* const end = p + s.size();
+	ParsedLine line;
+	if (!NextLine(p, end, line) || line.numTokens != 1 || !line.TokenIs(0, 'D')) return false;
+	
+	::Fleets& fleets = state.fleets; // Fleets alone is the member function here
+	state.InvalidateArrivals();
+	state.InvalidateFleetIndex();
+	state.InvalidateStats();
+	state.InvalidateHash();
+	bool agedFleets = false;
+	while (NextLine(p, end, line)) {
+		if (line.TokenIs(0, 'C')) {
+			if (line.numTokens != 4) return false;
+			int planet = line.Int(1);
+			if (planet < 0 || (size_t)planet >= state.planets.size()) return false;
+			state.planets[planet] = PlanetState(line.Int(2), line.Int(3));
+		}
+		else if (line.TokenIs(0, 'R')) {
+			if (agedFleets) return false;
+			// Removes the fleets in place, the indices are ascending.
+			const char* c = line.tokenEnd[0];
+			const char *tokenBegin, *tokenEnd;
+			size_t kept = 0, next = 0;
+			while (NextToken(c, line.end, tokenBegin, tokenEnd)) {
+				int removed = ScanInt(tokenBegin, tokenEnd);
+				if (removed < (int)next || (size_t)removed >= fleets.size()) return false;
+				for (; next < (size_t)removed; ++next, ++kept)
+					if (kept != next) fleets[kept] = fleets[next];
+				++next;
+			}
+			for (; next < fleets.size(); ++next, ++kept)
+				if (kept != next) fleets[kept] = fleets[next];
+			fleets.resize(kept);
+			FleetsTimeStep(fleets);
+			agedFleets = true;
+		}
+		else if (line.TokenIs(0, 'F')) {
+			if (line.numTokens != 7) return false;
+			if (!agedFleets) {
+				FleetsTimeStep(fleets);
+				agedFleets = true;
+			}
+			fleets.push_back(Fleet(line.Int(1), line.Int(2), line.Int(3), line.Int(4), line.Int(5), line.Int(6)));
+		}
+		else
+			return false;
+	}
+	if (!agedFleets) FleetsTimeStep(fleets);
+	state.UpdateArrivals();
+	return true;
+}
+
+void Game::RequestDelta() const {
+	if(orderSink) return;
+	std::cout << "delta" << std::endl;
+	std::cout.flush();
+}
+
+void Game::RequestMultiGame() const {
+	if(orderSink) return;
+	std::cout << "multigame" << std::endl;
+	std::cout.flush();
+}
+
+void Game::RequestClock() const {
+	if(orderSink) return;
+	std::cout << "clock" << std::endl;
+	std::cout.flush();
+}
+
+bool Game::ParseClock(const std::string& line) {
+	long bank, increment, limit;
+	if (sscanf(line.c_str(), "time %ld %ld %ld", &bank, &increment, &limit) != 3)
+		return false;
+	timeBank = bank;
+	timeIncrement = increment;
+	turnTimeLimit = limit;
+	return true;
+}
+
 bool Game::ParseGamePlaybackInitial(const std::string& s) {
 	clear();
 	std::vector<std::string> toks = Tokenize(s, ":");
@@ -409,11 +1741,16 @@ bool Game::ParseGamePlaybackInitial(const std::string& s) {
 		desc.planets.push_back(planetDesc);
 		state.planets.push_back(planetState);
 	}
+	desc.BuildDistances();
 	return true;	
 }
 
 bool GameState::ParseGamePlaybackChunk(const std::string& s) {
 	fleets.clear();
+	InvalidateArrivals();
+	InvalidateFleetIndex();
+	InvalidateStats();
+	InvalidateHash();
 	std::vector<std::string> items = Tokenize(s, ",");
 	
 	size_t numPlanets = 0;
@@ -446,89 +1783,92 @@ bool GameState::ParseGamePlaybackChunk(const std::string& s) {
 }
 
 
-// Loads a map from a test file. The text file contains a description of
-// the starting state of a game. See the project wiki for a description of
-// the file format. It should be called the Planet Wars Point-in-Time
-// format. On success, return true. On failure, returns false.
-bool Game::LoadMapFromFile(const std::string& mapFilename) {
-	std::ifstream f(mapFilename.c_str());
-	if(!f) return false;
-	std::string s = std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
-	return ParseGameState(s);
-}
-
-
-
-std::vector<Planet> Game::Planets() const {
-	std::vector<Planet> r;
-	for (size_t i = 0; i < NumPlanets(); ++i)
-		r.push_back(GetPlanet(i));
-	return r;
-}
+// Rows of the trip time table start on a cache line (64 bytes).
+static const size_t DistanceRowAlign = 64 / sizeof(GameDesc::DistanceEntry);
 
-std::vector<Planet> Game::MyPlanets() const {
-	std::vector<Planet> r;
-	for (size_t i = 0; i < NumPlanets(); ++i) {
-		if (state.planets[i].owner == 1)
-			r.push_back(GetPlanet(i));
+// Fills in the trip times between planet i and all planets j <= i.
+// Returns false if some trip time does not fit into a DistanceEntry.
+static bool SetDistancesFor(GameDesc& desc, size_t i) {
+	const int maxEntry = std::numeric_limits<GameDesc::DistanceEntry>::max();
+	GameDesc::DistanceEntry* table = &desc.distanceTable[desc.distanceOffset];
+	for (size_t j = 0; j <= i; ++j) {
+		int d = GameDesc::CalcDistance(desc.planets[i], desc.planets[j]);
+		if (d < 0 || d > maxEntry) return false;
+		table[i * desc.distanceStride + j] = table[j * desc.distanceStride + i] = d;
 	}
-	return r;
+	return true;
 }
 
-std::vector<Planet> Game::NeutralPlanets() const {
-	std::vector<Planet> r;
-	for (size_t i = 0; i < NumPlanets(); ++i) {
-		if (state.planets[i].owner == 0)
-			r.push_back(GetPlanet(i));
+// Allocates a table with room for at least minRows planets and fills it.
+static void BuildDistanceTable(GameDesc& desc, size_t minRows) {
+	const size_t n = desc.planets.size();
+	desc.distanceNumPlanets = 0;
+	desc.distanceSource = NULL;
+	desc.distanceStride = (minRows + DistanceRowAlign - 1) / DistanceRowAlign * DistanceRowAlign;
+	if (desc.distanceStride == 0) {
+		desc.distanceTable.clear();
+		desc.distanceOffset = 0;
+		return;
 	}
-	return r;
+	desc.distanceTable.assign(desc.distanceStride * desc.distanceStride + DistanceRowAlign - 1, 0);
+	size_t misalign = (size_t)&desc.distanceTable[0] % 64;
+	desc.distanceOffset = misalign ? (64 - misalign) / sizeof(GameDesc::DistanceEntry) : 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (!SetDistancesFor(desc, i)) return;
+	}
+	desc.distanceNumPlanets = n;
 }
 
-std::vector<Planet> Game::EnemyPlanets() const {
-	std::vector<Planet> r;
-	for (size_t i = 0; i < NumPlanets(); ++i) {
-		if (state.planets[i].owner > 1)
-			r.push_back(GetPlanet(i));
-	}
-	return r;
+void GameDesc::BuildDistances() {
+	BuildDistanceTable(*this, planets.size());
 }
 
-std::vector<Planet> Game::NotMyPlanets() const {
-	std::vector<Planet> r;
-	for (size_t i = 0; i < NumPlanets(); ++i) {
-		if (state.planets[i].owner != 1)
-			r.push_back(GetPlanet(i));
-	}
-	return r;
+void GameDesc::ShareDistances(const GameDesc& from) {
+	planets = from.planets;
+	distanceTable.clear();
+	distanceOffset = distanceStride = 0;
+	distanceNumPlanets = from.distanceNumPlanets;
+	distanceSource = from.distanceSource ? from.distanceSource : &from;
 }
 
-std::vector<Fleet> Game::Fleets() const {
-	std::vector<Fleet> r;
-	for (size_t i = 0; i < NumFleets(); ++i) {
-		r.push_back(GetFleet(i));
+void GameDesc::AddPlanet(const PlanetDesc& planet) {
+	bool haveTable = planets.empty() || HaveDistanceTable();
+	planets.push_back(planet);
+	if (!haveTable) return;
+	if (distanceSource) {
+		BuildDistances();
+		return;
 	}
-	return r;
+	
+	const size_t n = planets.size();
+	if (n > distanceStride)
+		BuildDistanceTable(*this, std::max(n, 2 * distanceStride));
+	else if (SetDistancesFor(*this, n - 1))
+		distanceNumPlanets = n;
 }
 
-std::vector<Fleet> Game::MyFleets() const {
-	std::vector<Fleet> r;
-	for (size_t i = 0; i < NumFleets(); ++i) {
-		if (state.fleets[i].owner == 1)
-			r.push_back(GetFleet(i));
-	}
-	return r;
+// Loads a map from a test file. The text file contains a description of
+// the starting state of a game. See the project wiki for a description of
+// the file format. It should be called the Planet Wars Point-in-Time
+// format. On success, return true. On failure, returns false.
+bool Game::LoadMapFromFile(const std::string& mapFilename) {
+	std::ifstream f(mapFilename.c_str());
+	if(!f) return false;
+	std::string s = std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+	return ParseGameState(s);
 }
 
-std::vector<Fleet> Game::EnemyFleets() const {
-	std::vector<Fleet> r;
-	for (size_t i = 0; i < NumFleets(); ++i) {
-		if (state.fleets[i].owner > 1)
-			r.push_back(GetFleet(i));
+
+
+int GameState::Production(int playerID, const GameDesc& desc) const {
+	if (statsValid) {
+		if (playerID < 0 || (size_t)playerID >= playerStats.size()) return 0;
+		return playerStats[playerID].production;
 	}
-	return r;
+	return ProductionScan(playerID, desc);
 }
 
-int GameState::Production(int playerID, const GameDesc& desc) const {
+int GameState::ProductionScan(int playerID, const GameDesc& desc) const {
 	int prod = 0;
 	for (size_t i = 0; i < desc.planets.size(); ++i) {
 		if (planets[i].owner == playerID)
@@ -537,9 +1877,120 @@ int GameState::Production(int playerID, const GameDesc& desc) const {
 	return prod;
 }
 
+#ifdef __linux__
+// The bot side of the shared memory transport (see shmring.h): the buffer of
+// std::cin and std::cout, so the bot reads and writes as usual.
+struct ShmBotStreambuf : std::streambuf {
+	ShmArea* area;
+	char inBuf[4096], outBuf[4096];
+	
+	ShmBotStreambuf(ShmArea* a) : area(a) {
+		setg(inBuf, inBuf, inBuf);
+		setp(outBuf, outBuf + sizeof(outBuf));
+	}
+	
+	// Until the engine wakes us up. Returns false if it is gone, i.e. it
+	// closed stdin (it doesn't write anything else to it anymore).
+	static bool Sleep() {
+		pollfd fds[2] = { { ShmBotWakeFd, POLLIN, 0 }, { STDIN_FILENO, POLLIN, 0 } };
+		while (poll(fds, 2, -1) < 0)
+			if (errno != EINTR) return false;
+		if (fds[1].revents) return false;
+		ShmClearWakeup(ShmBotWakeFd);
+		return true;
+	}
+	
+	int underflow() {
+		ShmRing& ring = area->toBot;
+		for (;;) {
+			const size_t n = ring.Read(inBuf, sizeof(inBuf));
+			if (n > 0) {
+				if (ring.WriterWaits()) ShmWake(ShmBotEngineWakeFd);
+				setg(inBuf, inBuf, inBuf + n);
+				return traits_type::to_int_type(inBuf[0]);
+			}
+			if (ShmSpin(ring, 0)) continue;
+			ring.SetReaderWaiting(true);
+			const bool awake = ring.Used() > 0 || Sleep();
+			ring.SetReaderWaiting(false);
+			if (!awake) return traits_type::eof();
+		}
+	}
+	
+	// Puts outBuf into the ring. A waiting engine only reads it when woken
+	// up, so we do that if the ring is full and otherwise only if asked for
+	// and there was something. std::cin is tied to std::cout, so every read
+	// asks for it.
+	bool Publish(bool wake) {
+		ShmRing& ring = area->toEngine;
+		const char* p = pbase();
+		if (p == pptr()) return true;
+		for (;;) {
+			p += ring.Write(p, pptr() - p);
+			if (p == pptr()) break;
+			if (ring.ReaderWaits()) ShmWake(ShmBotEngineWakeFd);
+			if (ShmSpin(ring, ShmRing::Size)) continue;
+			ring.SetWriterWaiting(true);
+			const bool awake = ring.Used() < (size_t)ShmRing::Size || Sleep();
+			ring.SetWriterWaiting(false);
+			if (!awake) return false;
+		}
+		setp(outBuf, outBuf + sizeof(outBuf));
+		if (wake && ring.ReaderWaits()) ShmWake(ShmBotEngineWakeFd);
+		return true;
+	}
+	
+	int overflow(int c) {
+		if (!Publish(false)) return traits_type::eof();
+		if (!traits_type::eq_int_type(c, traits_type::eof())) {
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+	
+	int sync() { return Publish(true) ? 0 : -1; }
+};
+
+static ShmBotStreambuf* shmStreambuf = NULL;
+#endif
+
+bool Game::RequestSharedMemory() const {
+	if(orderSink) return false;
+#ifdef __linux__
+	if(shmStreambuf) return true;
+	const char* fds = getenv(PW_SHM_ENV);
+	int memFd, wakeFd, engineWakeFd;
+	if(!fds || sscanf(fds, "%d %d %d", &memFd, &wakeFd, &engineWakeFd) != 3) return false;
+	if(memFd != ShmBotMemFd || wakeFd != ShmBotWakeFd || engineWakeFd != ShmBotEngineWakeFd) return false;
+	void* area = mmap(NULL, sizeof(ShmArea), PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+	if(area == MAP_FAILED) return false;
+	// The last line through the pipe.
+	std::cout << "shm" << std::endl;
+	std::cout.flush();
+	shmStreambuf = new ShmBotStreambuf((ShmArea*)area);
+	std::cin.rdbuf(shmStreambuf);
+	std::cout.rdbuf(shmStreambuf);
+	return true;
+#else
+	return false;
+#endif
+}
+
 void Game::IssueOrder(int source_planet,
                             int destination_planet,
                             int num_ships) const {
+	if(orderSink) {
+		orderSink->IssueOrder(Order(source_planet, destination_planet, num_ships));
+		return;
+	}
+#ifdef __linux__
+	// The engine needs them only with the go.
+	if(shmStreambuf) {
+		std::cout << source_planet << " " << destination_planet << " " << num_ships << "\n";
+		return;
+	}
+#endif
 	std::cout << source_planet << " "
 	<< destination_planet << " "
 	<< num_ships << std::endl;
@@ -547,6 +1998,7 @@ void Game::IssueOrder(int source_planet,
 }
 
 void Game::FinishTurn() const {
+	if(orderSink) return;
 	std::cout << "go" << std::endl;
 	std::cout.flush();
 }
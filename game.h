@@ -21,6 +21,9 @@
 #include <vector>
 #include <list>
 #include <cmath>
+#include <algorithm>
+#include <iterator>
+#include <cstddef>
 #include "vec.h"
 
 // This class stores details about one fleet. There is one of these classes
@@ -56,25 +59,312 @@ struct Fleet {
 	void Kill() { owner = numShips = turnsRemaining = 0; }
 };
 
-typedef std::vector<Fleet> Fleets;
+// Reference to a fleet stored in Fleets. It can be used like a Fleet&
+// (FleetRef) or a const Fleet& (ConstFleetRef). The member functions which
+// change the fleet also change Fleets::generation.
+template<typename Int>
+struct FleetRefT {
+	Int& owner;
+	Int& numShips;
+	Int& sourcePlanet;
+	Int& destinationPlanet;
+	Int& turnsRemaining;
+	Int& totalTripLength;
+	unsigned int* generation; // of the Fleets, NULL for a ConstFleetRef
+	
+	FleetRefT(Int& _owner, Int& _num_ships, Int& _source_planet, Int& _destination_planet,
+			  Int& _turns_remaining, Int& _total_trip_length, unsigned int* _generation = NULL)
+	: owner(_owner), numShips(_num_ships), sourcePlanet(_source_planet),
+	destinationPlanet(_destination_planet),
+	turnsRemaining(_turns_remaining), totalTripLength(_total_trip_length), generation(_generation) {}
+	
+	template<typename Int2>
+	FleetRefT(const FleetRefT<Int2>& f)
+	: owner(f.owner), numShips(f.numShips), sourcePlanet(f.sourcePlanet),
+	destinationPlanet(f.destinationPlanet),
+	turnsRemaining(f.turnsRemaining), totalTripLength(f.totalTripLength), generation(f.generation) {}
+	
+	operator Fleet() const {
+		return Fleet(owner, numShips, sourcePlanet, destinationPlanet, totalTripLength, turnsRemaining);
+	}
+	
+	const FleetRefT& operator=(const Fleet& f) const {
+		Changed();
+		owner = f.owner; numShips = f.numShips;
+		sourcePlanet = f.sourcePlanet; destinationPlanet = f.destinationPlanet;
+		turnsRemaining = f.turnsRemaining; totalTripLength = f.totalTripLength;
+		return *this;
+	}
+	
+	const FleetRefT& operator=(const FleetRefT& f) const { return *this = Fleet(f); }
+	
+	// so that iterator->owner works
+	const FleetRefT* operator->() const { return this; }
+	
+	void TimeStep() const {
+		Changed();
+		if (turnsRemaining > 0)
+            --turnsRemaining;
+        else
+            turnsRemaining = 0;
+	}
+	
+	int Age() const { return totalTripLength - turnsRemaining; }
+	
+	void Kill() const { Changed(); owner = numShips = turnsRemaining = 0; }
+	
+	void Changed() const { if (generation) ++*generation; }
+};
+
+typedef FleetRefT<int> FleetRef;
+typedef FleetRefT<const int> ConstFleetRef;
+
+// All fleets, stored as a structure of arrays, i.e. one array per Fleet
+// field. Most loops over the fleets only look at one or two of the fields.
+// Otherwise it can be used much like a std::vector<Fleet>.
+struct Fleets {
+	std::vector<int> owner;
+	std::vector<int> numShips;
+	std::vector<int> sourcePlanet;
+	std::vector<int> destinationPlanet;
+	std::vector<int> turnsRemaining;
+	std::vector<int> totalTripLength;
+	
+	// Changed by the member functions which add or remove fleets, by the
+	// ones of FleetRef which change a fleet (operator=, TimeStep, Kill) and
+	// by the functions below which modify the fleets, so that FleetArrivals
+	// and FleetIndex see when they became invalid. Reading doesn't change
+	// it. Neither does writing to the arrays above or to the fields of a
+	// FleetRef directly; call GameState::InvalidateArrivals() and
+	// InvalidateFleetIndex() then.
+	unsigned int generation;
+	
+	Fleets() : generation(0) {}
+	Fleets(const Fleets& f)
+	: owner(f.owner), numShips(f.numShips), sourcePlanet(f.sourcePlanet),
+	destinationPlanet(f.destinationPlanet), turnsRemaining(f.turnsRemaining),
+	totalTripLength(f.totalTripLength), generation(f.generation) {}
+	// Afterwards, the generation differs from both previous ones, so neither
+	// an index of these fleets nor one of f counts as valid by accident.
+	Fleets& operator=(const Fleets& f) {
+		owner = f.owner; numShips = f.numShips;
+		sourcePlanet = f.sourcePlanet; destinationPlanet = f.destinationPlanet;
+		turnsRemaining = f.turnsRemaining; totalTripLength = f.totalTripLength;
+		generation = std::max(generation, f.generation) + 1;
+		return *this;
+	}
+	
+	typedef size_t size_type;
+	typedef Fleet value_type;
+	typedef FleetRef reference;
+	typedef ConstFleetRef const_reference;
+	
+	template<typename Ref, typename Container>
+	struct Iterator {
+		typedef std::random_access_iterator_tag iterator_category;
+		typedef Fleet value_type;
+		typedef ptrdiff_t difference_type;
+		typedef Ref pointer;
+		typedef Ref reference;
+		
+		Container* fleets;
+		size_t index;
+		
+		Iterator(Container* _fleets = NULL, size_t _index = 0) : fleets(_fleets), index(_index) {}
+		template<typename Ref2, typename Container2>
+		Iterator(const Iterator<Ref2,Container2>& it) : fleets(it.fleets), index(it.index) {}
+		
+		Ref operator*() const { return (*fleets)[index]; }
+		Ref operator->() const { return (*fleets)[index]; }
+		Ref operator[](ptrdiff_t i) const { return (*fleets)[index + i]; }
+		Iterator& operator++() { ++index; return *this; }
+		Iterator& operator--() { --index; return *this; }
+		Iterator operator++(int) { Iterator it(*this); ++index; return it; }
+		Iterator operator--(int) { Iterator it(*this); --index; return it; }
+		Iterator& operator+=(ptrdiff_t i) { index += i; return *this; }
+		Iterator& operator-=(ptrdiff_t i) { index -= i; return *this; }
+		Iterator operator+(ptrdiff_t i) const { return Iterator(fleets, index + i); }
+		Iterator operator-(ptrdiff_t i) const { return Iterator(fleets, index - i); }
+		ptrdiff_t operator-(const Iterator& it) const { return (ptrdiff_t)index - (ptrdiff_t)it.index; }
+		bool operator==(const Iterator& it) const { return index == it.index; }
+		bool operator!=(const Iterator& it) const { return index != it.index; }
+		bool operator<(const Iterator& it) const { return index < it.index; }
+	};
+	typedef Iterator<FleetRef, Fleets> iterator;
+	typedef Iterator<ConstFleetRef, const Fleets> const_iterator;
+	
+	size_t size() const { return owner.size(); }
+	bool empty() const { return owner.empty(); }
+	
+	FleetRef operator[](size_t i) {
+		return FleetRef(owner[i], numShips[i], sourcePlanet[i], destinationPlanet[i], turnsRemaining[i], totalTripLength[i], &generation);
+	}
+	ConstFleetRef operator[](size_t i) const {
+		return ConstFleetRef(owner[i], numShips[i], sourcePlanet[i], destinationPlanet[i], turnsRemaining[i], totalTripLength[i]);
+	}
+	FleetRef back() { return (*this)[size() - 1]; }
+	ConstFleetRef back() const { return (*this)[size() - 1]; }
+	
+	iterator begin() { return iterator(this, 0); }
+	iterator end() { return iterator(this, size()); }
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, size()); }
+	
+	void push_back(const Fleet& f) {
+		++generation;
+		owner.push_back(f.owner);
+		numShips.push_back(f.numShips);
+		sourcePlanet.push_back(f.sourcePlanet);
+		destinationPlanet.push_back(f.destinationPlanet);
+		turnsRemaining.push_back(f.turnsRemaining);
+		totalTripLength.push_back(f.totalTripLength);
+	}
+	void pop_back() { resize(size() - 1); }
+	
+	void resize(size_t n) {
+		++generation;
+		owner.resize(n); numShips.resize(n);
+		sourcePlanet.resize(n); destinationPlanet.resize(n);
+		turnsRemaining.resize(n); totalTripLength.resize(n);
+	}
+	void reserve(size_t n) {
+		owner.reserve(n); numShips.reserve(n);
+		sourcePlanet.reserve(n); destinationPlanet.reserve(n);
+		turnsRemaining.reserve(n); totalTripLength.reserve(n);
+	}
+	void clear() { resize(0); }
+	void swap(Fleets& f) {
+		owner.swap(f.owner); numShips.swap(f.numShips);
+		sourcePlanet.swap(f.sourcePlanet); destinationPlanet.swap(f.destinationPlanet);
+		turnsRemaining.swap(f.turnsRemaining); totalTripLength.swap(f.totalTripLength);
+		generation = f.generation = std::max(generation, f.generation) + 1;
+	}
+};
+
+// The following work on whole Fleets at once. They are vectorized with
+// SSE2 or AVX2 if the compiler targets it (e.g. -march=native) and
+// PW_NO_SIMD is not defined.
 
 inline void FleetsTimeStep(Fleets::iterator f, const Fleets::iterator& fleetEnd) {
 	for (; f != fleetEnd; ++f) f->TimeStep();
 }
 
-inline void FleetsTimeStep(Fleets& fleets) {
-	FleetsTimeStep(fleets.begin(), fleets.end());
-}
+void FleetsTimeStep(Fleets& fleets);
 
-inline void RemoveFinalFleets(Fleets& fleets) {
-	Fleets newFleets;
-	newFleets.reserve(fleets.size());
-	for (Fleets::iterator f = fleets.begin(); f != fleets.end(); ++f) {
-		if(f->turnsRemaining > 0)
-			newFleets.push_back(*f);
+// Same as k times FleetsTimeStep.
+void FleetsTimeSteps(Fleets& fleets, int k);
+
+// Removes all fleets with turnsRemaining <= 0. This keeps the order.
+void RemoveFinalFleets(Fleets& fleets);
+
+// Sum of numShips of all fleets of the given owner.
+int FleetsNumShips(const Fleets& fleets, int owner);
+
+// True if there is some fleet of the given owner.
+bool FleetsHaveOwner(const Fleets& fleets, int owner);
+
+// Highest owner of all fleets, or 0 if there are no fleets.
+int FleetsHighestOwner(const Fleets& fleets);
+
+// Index of the fleets by destination planet. For every planet, the indices
+// of the fleets heading there are sorted by turnsRemaining, so the fleets
+// arriving in dt turns are one contiguous range. FleetsTimeStep keeps the
+// index valid, and RemoveFinal updates it for RemoveFinalFleets; adding,
+// removing or redirecting fleets otherwise does not. Any change of the
+// fleets (see Fleets::generation) makes IsValidFor false, also the ones
+// which keep it valid; then call Revalidate.
+struct FleetArrivals {
+	// fleets heading to planet p are fleetIds[planetBegin[p] .. planetBegin[p+1])
+	std::vector<int> planetBegin;
+	std::vector<int> fleetIds;
+	std::vector<int> scratchCounts, scratchOrder; // only used by Build() and RemoveFinal()
+	size_t numFleets; // fleets.size() at the time of Build()
+	unsigned int generation; // fleets.generation at the time of Build()
+	
+	FleetArrivals() : numFleets(0), generation(0) {}
+	// The scratch buffers are not copied.
+	FleetArrivals(const FleetArrivals& a)
+	: planetBegin(a.planetBegin), fleetIds(a.fleetIds), numFleets(a.numFleets), generation(a.generation) {}
+	FleetArrivals& operator=(const FleetArrivals& a) {
+		planetBegin = a.planetBegin;
+		fleetIds = a.fleetIds;
+		numFleets = a.numFleets;
+		generation = a.generation;
+		return *this;
 	}
-	fleets.swap(newFleets);	
-}
+	
+	void Build(const Fleets& fleets, size_t numPlanets);
+	
+	bool IsValidFor(const Fleets& fleets, size_t numPlanets) const {
+		return generation == fleets.generation && numFleets == fleets.size() && planetBegin.size() == numPlanets + 1;
+	}
+	
+	// The fleets were changed in a way which keeps the index valid.
+	void Revalidate(const Fleets& fleets) { generation = fleets.generation; numFleets = fleets.size(); }
+	
+	// Call this right before RemoveFinalFleets(fleets) and Revalidate right
+	// after it. Drops the fleets which will be removed from the buckets
+	// (they are at the front, with turnsRemaining <= 0) and renumbers the
+	// others. Returns the new index of every fleet, -1 for removed ones,
+	// which stays valid until the next Build or RemoveFinal. O(fleets).
+	const std::vector<int>& RemoveFinal(const Fleets& fleets);
+	
+	// Sets [begin,end) to the indices of the fleets arriving at the planet
+	// in exactly dt turns (i.e. with turnsRemaining == dt).
+	void Arriving(const Fleets& fleets, int planet, int dt, const int*& begin, const int*& end) const;
+};
+
+// Hash index of the fleets by (owner, sourcePlanet, destinationPlanet,
+// arrival turn). Used to merge new fleets into existing ones. It uses
+// open addressing; every slot is a fleet index, -1 (empty) or -2 (a removed
+// fleet). If several fleets have the same key, the first one is indexed.
+// The arrival turn is turnsRemaining + turnsPassed, so time steps keep the
+// index valid when TimeSteps is called; RemoveFinal updates it for
+// RemoveFinalFleets. Other changes of the key fields or removing fleets make
+// it invalid. Like FleetArrivals, it checks Fleets::generation; call
+// Revalidate after the changes which keep it valid.
+struct FleetIndex {
+	std::vector<int> slots; // size is a power of two
+	size_t numKeys; // used slots, also the ones of removed fleets
+	size_t numFleets; // fleets.size() at the time of the last update
+	unsigned int generation; // fleets.generation at the time of the last update
+	int turnsPassed; // since the last Build
+	
+	FleetIndex() : numKeys(0), numFleets(0), generation(0), turnsPassed(0) {}
+	
+	void Build(const Fleets& fleets);
+	
+	bool IsValidFor(const Fleets& fleets) const {
+		return generation == fleets.generation && numFleets == fleets.size();
+	}
+	
+	// Returns the index of the first fleet with the given key or -1.
+	int Find(const Fleets& fleets, int owner, int sourcePlanet, int destinationPlanet, int turnsRemaining) const;
+	
+	// Adds fleets.back().
+	void AddLast(const Fleets& fleets);
+	
+	// All fleets were aged by n turns (FleetsTimeStep or FleetsTimeSteps).
+	void TimeSteps(int n) { turnsPassed += n; }
+	
+	// Renumbers the fleets with the result of FleetArrivals::RemoveFinal,
+	// before RemoveFinalFleets. O(slots).
+	void RemoveFinal(const std::vector<int>& newIds);
+	
+	void Revalidate(const Fleets& fleets) { generation = fleets.generation; numFleets = fleets.size(); }
+};
+
+// The simulation can be specialized for a maximum player count (the highest
+// owner id which can appear). With a fixed count, battles are resolved on a
+// fixed-size array. DynamicPlayers supports any number of players.
+static const int DynamicPlayers = 0;
+
+// What the non-template functions use.
+#ifdef ONLY2PLAYERS
+static const int DefaultMaxPlayers = 2;
+#else
+static const int DefaultMaxPlayers = DynamicPlayers;
+#endif
 
 // all gamestate relevant information about a planet
 struct PlanetState {
@@ -87,19 +377,54 @@ struct PlanetState {
 	//Resolves the battle at planet p, if there is one.
 	// fleets with turnsRemaining=dt are checked here.
     // * Sets the number of ships and owner of the planet according the outcome
-	void FightBattle(int myPlanetIndex, const Fleets& fleets, int dt = 0);
+	void FightBattle(int myPlanetIndex, const Fleets& fleets, int dt = 0) {
+		FightBattle<DefaultMaxPlayers>(myPlanetIndex, fleets, dt);
+	}
+	// Same as above but only looks at the arriving fleets. The arrivals
+	// index must be valid for fleets.
+	void FightBattle(int myPlanetIndex, const Fleets& fleets, const FleetArrivals& arrivals, int dt = 0) {
+		FightBattle<DefaultMaxPlayers>(myPlanetIndex, fleets, arrivals, dt);
+	}
+	// Specialized for MaxPlayers (2, 4, 8 or DynamicPlayers).
+	template<int MaxPlayers> void FightBattle(int myPlanetIndex, const Fleets& fleets, int dt = 0);
+	template<int MaxPlayers> void FightBattle(int myPlanetIndex, const Fleets& fleets, const FleetArrivals& arrivals, int dt = 0);
 
 	// Fleets must already be one time step ahead
 	void DoTimeStep(int myPlanetIndex, int growthRate, const Fleets& fleets, int dt = 0) {
 		if(owner > 0) numShips += growthRate;
 		FightBattle(myPlanetIndex, fleets, dt);
 	}
+	
+	void DoTimeStep(int myPlanetIndex, int growthRate, const Fleets& fleets, const FleetArrivals& arrivals, int dt = 0) {
+		if(owner > 0) numShips += growthRate;
+		FightBattle(myPlanetIndex, fleets, arrivals, dt);
+	}
+		
+	// Does k time steps in which no fleets arrive here. This gives exactly
+	// the same result as k times DoTimeStep.
+	void DoQuietTimeSteps(int growthRate, int k) {
+		if (k <= 0) return;
+		if (owner > 0) {
+			if (growthRate >= 0)
+				numShips = std::max(numShips + growthRate, 0) + growthRate * (k - 1);
+			else
+				numShips = std::max(numShips + growthRate * k, 0);
+		}
+		else
+			numShips = std::max(numShips, 0);
+	}
 		
 	PlanetState NextTimeStep(int myPlanetIndex, int growthRate, const Fleets& fleets, int dt = 0) const {
 		PlanetState state(*this);
 		state.DoTimeStep(myPlanetIndex, growthRate, fleets, dt);
 		return state;
 	}
+
+	PlanetState NextTimeStep(int myPlanetIndex, int growthRate, const Fleets& fleets, const FleetArrivals& arrivals, int dt = 0) const {
+		PlanetState state(*this);
+		state.DoTimeStep(myPlanetIndex, growthRate, fleets, arrivals, dt);
+		return state;
+	}
 };
 
 // planet description. all the game global constants
@@ -120,12 +445,113 @@ struct Planet : PlanetDesc, PlanetState {
 	: PlanetDesc(desc), PlanetState(state), planetId(_planet_id) {}
 };
 
+// An order to send numShips ships from sourcePlanet to destinationPlanet.
+struct Order {
+	int sourcePlanet;
+	int destinationPlanet;
+	int numShips;
+	
+	Order(int _source_planet = -1, int _destination_planet = -1, int _num_ships = 0)
+	: sourcePlanet(_source_planet), destinationPlanet(_destination_planet), numShips(_num_ships) {}
+};
+
+// Takes the orders of a bot which runs inside the engine (see botplugin.h)
+// instead of them being written to stdout.
+struct OrderSink {
+	virtual ~OrderSink() {}
+	virtual void IssueOrder(const Order& order) = 0;
+};
+
 struct GameDesc;
+struct GameStateUndo;
 
 struct GameState {
 	typedef std::vector<PlanetState> Planets;
 	Planets planets;
 	Fleets fleets;
+	
+	// Index of the fleets by destination and arrival time. It is kept up-to-date
+	// by all functions of GameState. Changes through the member functions of
+	// Fleets and FleetRef are noticed (see Fleets::generation); if you write
+	// to the arrays or fields of fleets directly, call InvalidateArrivals().
+	FleetArrivals arrivals;
+	bool arrivalsValid;
+	
+	// Index of the fleets for MatchingExistingFleet. Same as with arrivals:
+	// if you write to the arrays of fleets directly, call InvalidateFleetIndex().
+	FleetIndex fleetIndex;
+	bool fleetIndexValid;
+	
+	void InvalidateFleetIndex() { fleetIndexValid = false; }
+	bool HaveFleetIndex() const { return fleetIndexValid && fleetIndex.IsValidFor(fleets); }
+	const FleetIndex& UpdateFleetIndex() {
+		if(!HaveFleetIndex()) { fleetIndex.Build(fleets); fleetIndexValid = true; }
+		return fleetIndex;
+	}
+	
+	// Aggregates per player, indexed by owner. They are only used after
+	// UpdateStats() was called (the engine does that). From then on, all
+	// functions of GameState keep them up-to-date, which makes IsAlive,
+	// Winner, NumShips, Production and HighestPlayerID O(players). If you
+	// modify planets or fleets directly, call UpdateStats() again.
+	struct PlayerStats {
+		int numPlanets, shipsOnPlanets, production;
+		int numFleets, shipsInFleets;
+		PlayerStats() : numPlanets(0), shipsOnPlanets(0), production(0), numFleets(0), shipsInFleets(0) {}
+		bool IsAlive() const { return numPlanets > 0 || numFleets > 0; }
+	};
+	std::vector<PlayerStats> playerStats;
+	bool statsValid;
+	
+	// Zobrist hash of the position: planet owners, bucketed ship counts and
+	// the multiset of fleets. The terms are summed per owner, so that the
+	// owners can be renamed afterwards (see Hash(pov)). Like the stats, it
+	// is only kept up-to-date after UpdateHash() was called. If you modify
+	// planets or fleets directly, call UpdateHash() again.
+	typedef unsigned long long HashValue;
+	struct HashTerms {
+		HashValue planets, fleets;
+		HashTerms() : planets(0), fleets(0) {}
+	};
+	std::vector<HashTerms> hashTerms;
+	bool hashValid;
+	
+	GameState() : arrivalsValid(false), fleetIndexValid(false), statsValid(false), hashValid(false) {}
+	
+	// Removes all planets and fleets but keeps the allocated memory.
+	void clear() {
+		planets.clear(); fleets.clear(); playerStats.clear(); hashTerms.clear();
+		arrivalsValid = fleetIndexValid = statsValid = hashValid = false;
+	}
+	
+	void UpdateHash();
+	void InvalidateHash() { hashValid = false; }
+	bool HaveHash() const { return hashValid; }
+	// The hash of the position as player pov sees it, i.e. with the owners
+	// renamed by Game::PovSwitch. Thus a position and its mirror with two
+	// players swapped have the same hash for the respective pov. pov = -1
+	// means no renaming. O(players) after UpdateHash(), otherwise a full scan.
+	HashValue Hash(int pov = -1) const;
+	HashValue HashScan(int pov = -1) const;
+	
+	// Makes this a copy of the planets and fleets of from, with the owners
+	// renamed as player pov sees them (see Game::PovSwitch).
+	void AssignPov(const GameState& from, int pov);
+	
+	void UpdateStats(const GameDesc& desc);
+	void InvalidateStats() { statsValid = false; }
+	bool HaveStats() const { return statsValid; }
+	// Compares the stats against the full scans. With CHECKSTATS defined,
+	// this is asserted after every change.
+	bool CheckStats(const GameDesc& desc) const;
+	
+	void InvalidateArrivals() { arrivalsValid = false; }
+	bool HaveArrivals() const { return arrivalsValid && arrivals.IsValidFor(fleets, planets.size()); }
+	// Rebuilds the arrivals index if needed and returns it.
+	const FleetArrivals& UpdateArrivals() {
+		if(!HaveArrivals()) { arrivals.Build(fleets, planets.size()); arrivalsValid = true; }
+		return arrivals;
+	}
 
 	// Parses a chunk from a game playback.
 	// NOTE: the planets.size must fit!
@@ -135,17 +561,32 @@ struct GameState {
 	//   * Planet bonuses are added to non-neutral planets.
 	//   * Fleets are advanced towards their destinations.
 	//   * Fleets that arrive at their destination are dealt with.
-	void DoTimeStep(const GameDesc& desc);	
+	void DoTimeStep(const GameDesc& desc) { DoTimeStep<DefaultMaxPlayers>(desc); }
+	// Same but records everything it changes in undo. See Undo().
+	void DoTimeStep(const GameDesc& desc, GameStateUndo& undo) { DoTimeStep<DefaultMaxPlayers>(desc, &undo); }
 
-	// several at once. we maybe can optimise this later
-	void DoTimeSteps(int n, const GameDesc& desc) {
-		while(n > 0) { DoTimeStep(desc); --n; }
-	}
+	// Same as n times DoTimeStep. Time steps in which no fleet arrives
+	// are skipped over at once.
+	void DoTimeSteps(int n, const GameDesc& desc) { DoTimeSteps<DefaultMaxPlayers>(n, desc); }
+	
+	// Specialized for MaxPlayers (2, 4, 8 or DynamicPlayers).
+	template<int MaxPlayers> void DoTimeStep(const GameDesc& desc, GameStateUndo* undo = NULL);
+	template<int MaxPlayers> void DoTimeSteps(int n, const GameDesc& desc);
+	
+	// Number of time steps until the next fleet arrives (at least 1).
+	// If there are no fleets, returns the highest int.
+	int NextArrival() const;
 	
 	// returns a copy with one timestep ahead
 	GameState NextTimeStep(const GameDesc& desc) const {
 		GameState s(*this); s.DoTimeStep(desc); return s;
 	}
+	
+	// Same but writes into next. This reuses the memory of next, so if you
+	// reuse next, it doesn't allocate anything once it is big enough.
+	void NextTimeStep(const GameDesc& desc, GameState& next) const {
+		next = *this; next.DoTimeStep(desc);
+	}
 		
 	// Execute an order. This function takes num_ships off the source_planet,
 	// puts them into a newly-created fleet, calculates the distance to the
@@ -153,11 +594,28 @@ struct GameState {
 	// distance. Checks that the given player_id is allowed to give the given
 	// order. If the order was carried out without any issue, and everything
 	// is peachy, then true is returned. Otherwise, false is returned.
+	// If undo is given, the order is recorded in its current step.
 	bool ExecuteOrder(const GameDesc& desc,
 					  int playerID,
 					  int sourcePlanet,
 					  int destinationPlanet,
-					  int numShips);		
+					  int numShips,
+					  GameStateUndo* undo = NULL);		
+	
+	// Executes all the orders of the player and records them as one step
+	// in undo. Invalid orders are skipped. Returns true if all were valid.
+	bool ApplyOrders(const GameDesc& desc,
+					 int playerID,
+					 const std::vector<Order>& orders,
+					 GameStateUndo& undo);
+	
+	// Reverts the last step recorded in undo (by ApplyOrders or DoTimeStep)
+	// and removes it from undo. The state is restored exactly, except that
+	// the arrivals and fleet indices have to be rebuilt. Returns false if
+	// there was nothing to undo.
+	// This allows a depth-first search on a single GameState instead of
+	// copying it for every node.
+	bool Undo(GameStateUndo& undo);
 	
 	// Kicks a player out of the game. This is used in cases where a player
 	// tries to give an illegal order or runs over the time limit.
@@ -184,26 +642,246 @@ struct GameState {
 
 	int HighestPlayerID() const;
 	
-	// checks owner, source, dest, turns-remaining
-	Fleet* MatchingExistingFleet(const Fleet& f);
+	// The same as above but always scan over all planets and fleets.
+	bool IsAliveScan(int playerID) const;
+	int WinnerScan(bool maxTurnsReached) const;
+	int NumShipsScan(int playerID) const;
+	int NumShipsOnPlanetsScan(int playerID) const;
+    int ProductionScan(int playerID, const GameDesc& desc) const;
+	int HighestPlayerIDScan() const;
+	
+	// checks owner, source, dest, turns-remaining.
+	// Returns the index of the fleet or -1 if there is none.
+	// Uses the fleetIndex if it is valid.
+	int MatchingExistingFleet(const Fleet& f) const;
+};
+
+// Records the changes of GameState::ApplyOrders and GameState::DoTimeStep
+// so that GameState::Undo can revert them. Reuse it to avoid allocations.
+struct GameStateUndo {
+	// One executed order.
+	struct OrderEntry {
+		int sourcePlanet;
+		int numShips;
+		int fleetId; // the fleet it was merged into or created
+		bool newFleet;
+	};
+	// A planet as it was before the time step changed it.
+	struct PlanetEntry {
+		int planet;
+		PlanetState before;
+	};
+	// A fleet which was removed by the time step, as it was before it.
+	struct FleetEntry {
+		int fleetId;
+		Fleet before;
+		FleetEntry(int _fleet_id, const Fleet& _before) : fleetId(_fleet_id), before(_before) {}
+	};
+	
+	struct Step {
+		bool isTimeStep;
+		bool statsValid, hashValid;
+		size_t ordersBegin, planetsBegin, fleetsBegin, statsBegin, hashBegin;
+	};
+	
+	std::vector<Step> steps;
+	std::vector<OrderEntry> orders;
+	std::vector<PlanetEntry> planets;
+	std::vector<FleetEntry> fleets;
+	std::vector<GameState::PlayerStats> stats;
+	std::vector<GameState::HashTerms> hashTerms;
+	
+	bool empty() const { return steps.empty(); }
+	size_t NumSteps() const { return steps.size(); }
+	void clear() {
+		steps.clear(); orders.clear(); planets.clear(); fleets.clear();
+		stats.clear(); hashTerms.clear();
+	}
+	
+	// Starts a new step. Used by GameState.
+	void BeginStep(const GameState& state, bool isTimeStep);
 };
 
 struct GameDesc {
 	typedef std::vector<PlanetDesc> Planets;
 	Planets planets;
 
+	// Trip times between all pairs of planets, see BuildDistances().
+	// Row i starts at distanceTable[distanceOffset + i * distanceStride].
+	// The stride is padded so that every row starts on a cache line. The
+	// trip times of real maps are far below 256; bigger ones disable the
+	// table (see HaveDistanceTable).
+	typedef unsigned char DistanceEntry;
+	std::vector<DistanceEntry> distanceTable;
+	size_t distanceOffset, distanceStride;
+	size_t distanceNumPlanets; // number of planets covered by the table
+	// If not NULL, the table of this desc is used instead of our own, see
+	// ShareDistances().
+	const GameDesc* distanceSource;
+
+	GameDesc() : distanceOffset(0), distanceStride(0), distanceNumPlanets(0), distanceSource(NULL) {}
+	
+	// Removes all planets but keeps the allocated memory.
+	void clear() {
+		planets.clear(); distanceTable.clear();
+		distanceOffset = distanceStride = distanceNumPlanets = 0;
+		distanceSource = NULL;
+	}
+
+	static int CalcDistance(const PlanetDesc& source, const PlanetDesc& destination) {
+		double dx = source.x - destination.x;
+		double dy = source.y - destination.y;
+		return (int)ceil(sqrt(dx * dx + dy * dy));
+	}
+
+	// (Re)builds the trip time table for all planets. Call this after you
+	// have modified the planets directly. Game::ParseGameState and
+	// Game::LoadMapFromFile do this for you; ParseGameState only when the
+	// planets moved.
+	void BuildDistances();
+	
+	// Makes this a copy of the planets of from which uses the trip time
+	// table of from instead of copying it. O(planets). from must stay
+	// unchanged as long as we use its table, i.e. until the next
+	// ShareDistances, BuildDistances, AddPlanet, clear or ParseGameState.
+	void ShareDistances(const GameDesc& from);
+
+	// Adds a planet and keeps the trip time table up-to-date.
+	void AddPlanet(const PlanetDesc& planet);
+
+	// True if the trip time table covers all planets. If not (e.g. planets
+	// were added directly or some distance does not fit into DistanceEntry),
+	// Distance() falls back to calculating it.
+	bool HaveDistanceTable() const {
+		return distanceNumPlanets > 0 && distanceNumPlanets == planets.size();
+	}
+
+	// Returns all trip times from the given planet, indexed by the
+	// destination planet. Only valid if HaveDistanceTable().
+	const DistanceEntry* DistanceRow(int sourcePlanet) const {
+		const GameDesc& table = distanceSource ? *distanceSource : *this;
+		return &table.distanceTable[table.distanceOffset + sourcePlanet * table.distanceStride];
+	}
+
     // Returns the distance between two planets, rounded up to the next highest
     // integer. This is the number of discrete time steps it takes to get
     // between the two planets.
     int Distance(int sourcePlanet, int destinationPlanet) const {
-		const PlanetDesc& source = planets[sourcePlanet];
-		const PlanetDesc& destination = planets[destinationPlanet];
-		double dx = source.x - destination.x;
-		double dy = source.y - destination.y;
-		return (int)ceil(sqrt(dx * dx + dy * dy));		
+		if(HaveDistanceTable())
+			return DistanceRow(sourcePlanet)[destinationPlanet];
+		return CalcDistance(planets[sourcePlanet], planets[destinationPlanet]);
 	}
 };
 
+// Which planets or fleets a view contains. By convention, the current
+// player is always player number 1.
+enum OwnerFilter { OwnerAll, OwnerMe, OwnerNeutral, OwnerEnemy, OwnerNotMe };
+
+inline bool OwnerFilterMatches(OwnerFilter filter, int owner) {
+	switch(filter) {
+		case OwnerMe: return owner == 1;
+		case OwnerNeutral: return owner == 0;
+		case OwnerEnemy: return owner > 1;
+		case OwnerNotMe: return owner != 1;
+		default: return true;
+	}
+}
+
+// Lazy view of all planets whose owner matches the filter. It doesn't
+// allocate anything; the iterator yields the same Planet as Game::GetPlanet.
+// Like the planets themselves, it is only valid as long as the game is.
+struct PlanetView {
+	const GameDesc* desc;
+	const GameState* state;
+	OwnerFilter filter;
+	
+	PlanetView(const GameDesc& _desc, const GameState& _state, OwnerFilter _filter = OwnerAll)
+	: desc(&_desc), state(&_state), filter(_filter) {}
+	
+	// For iterator->member.
+	struct Pointer {
+		Planet planet;
+		Pointer(const Planet& _planet) : planet(_planet) {}
+		const Planet* operator->() const { return &planet; }
+	};
+	
+	struct const_iterator {
+		typedef std::forward_iterator_tag iterator_category;
+		typedef Planet value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef Pointer pointer;
+		typedef Planet reference;
+		
+		const GameDesc* desc;
+		const GameState* state;
+		OwnerFilter filter;
+		int planetId;
+		
+		const_iterator(const PlanetView& view, int _planet_id)
+		: desc(view.desc), state(view.state), filter(view.filter), planetId(_planet_id) { SkipFiltered(); }
+		void SkipFiltered() {
+			while ((size_t)planetId < state->planets.size() && !OwnerFilterMatches(filter, state->planets[planetId].owner))
+				++planetId;
+		}
+		Planet operator*() const { return Planet(planetId, desc->planets[planetId], state->planets[planetId]); }
+		Pointer operator->() const { return Pointer(**this); }
+		const_iterator& operator++() { ++planetId; SkipFiltered(); return *this; }
+		const_iterator operator++(int) { const_iterator it = *this; ++*this; return it; }
+		bool operator==(const const_iterator& it) const { return planetId == it.planetId; }
+		bool operator!=(const const_iterator& it) const { return planetId != it.planetId; }
+	};
+	typedef const_iterator iterator;
+	
+	const_iterator begin() const { return const_iterator(*this, 0); }
+	const_iterator end() const { return const_iterator(*this, (int)state->planets.size()); }
+	bool empty() const { return begin() == end(); }
+	// Counts the planets, O(planets).
+	size_t size() const { return std::distance(begin(), end()); }
+	std::vector<Planet> ToVector() const { return std::vector<Planet>(begin(), end()); }
+};
+
+// Same as PlanetView for the fleets. The iterator yields a ConstFleetRef.
+struct FleetView {
+	const Fleets* fleets;
+	OwnerFilter filter;
+	
+	FleetView(const Fleets& _fleets, OwnerFilter _filter = OwnerAll)
+	: fleets(&_fleets), filter(_filter) {}
+	
+	struct const_iterator {
+		typedef std::forward_iterator_tag iterator_category;
+		typedef Fleet value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef ConstFleetRef pointer;
+		typedef ConstFleetRef reference;
+		
+		const Fleets* fleets;
+		OwnerFilter filter;
+		int fleetId;
+		
+		const_iterator(const FleetView& view, int _fleet_id)
+		: fleets(view.fleets), filter(view.filter), fleetId(_fleet_id) { SkipFiltered(); }
+		void SkipFiltered() {
+			while ((size_t)fleetId < fleets->size() && !OwnerFilterMatches(filter, fleets->owner[fleetId]))
+				++fleetId;
+		}
+		ConstFleetRef operator*() const { return (*fleets)[fleetId]; }
+		ConstFleetRef operator->() const { return (*fleets)[fleetId]; }
+		const_iterator& operator++() { ++fleetId; SkipFiltered(); return *this; }
+		const_iterator operator++(int) { const_iterator it = *this; ++*this; return it; }
+		bool operator==(const const_iterator& it) const { return fleetId == it.fleetId; }
+		bool operator!=(const const_iterator& it) const { return fleetId != it.fleetId; }
+	};
+	typedef const_iterator iterator;
+	
+	const_iterator begin() const { return const_iterator(*this, 0); }
+	const_iterator end() const { return const_iterator(*this, (int)fleets->size()); }
+	bool empty() const { return begin() == end(); }
+	// Counts the fleets, O(fleets).
+	size_t size() const { return std::distance(begin(), end()); }
+	std::vector<Fleet> ToVector() const { return std::vector<Fleet>(begin(), end()); }
+};
+
 struct Game {
 	GameDesc desc;
 	GameState state;
@@ -220,18 +898,41 @@ struct Game {
 	
 	// This is the name of the file in which to write log messages.
 	std::ostream* logFile;
+	
+	// If set, IssueOrder goes there and FinishTurn and RequestDelta do
+	// nothing, instead of writing to stdout.
+	OrderSink* orderSink;
+	
+	// If the engine plays with a time bank (and the bot asked for it with
+	// RequestClock), what is left in it, what is added after each turn and
+	// how long this turn may take at most, in ms. Otherwise -1.
+	long timeBank, timeIncrement, turnTimeLimit;
 
     // This constructor does not actually initialize the game object. You must
     // always call Init() before the game object will be in any kind of
     // coherent state.
 	Game(int _maxGameLength = 0, std::ostream* _gamePlayback = NULL, std::ostream* _logFile = NULL)
 	: maxGameLength(_maxGameLength), numTurns(0),
-	gamePlayback(_gamePlayback), logFile(_logFile) {}
+	gamePlayback(_gamePlayback), logFile(_logFile), orderSink(NULL),
+	timeBank(-1), timeIncrement(-1), turnTimeLimit(-1) {}
 
-	void clear() { desc = GameDesc(); state = GameState(); }
+	void clear() { desc.clear(); state.clear(); }
 	
 	// Parses a game state from a string. On success, returns true. On failure, returns false.
 	bool ParseGameState(const std::string& s);
+	
+	// Applies a delta (see GameStateDelta) to the current state, which must
+	// be the one the engine sent the turn before. On failure, returns false
+	// and the state is undefined.
+	bool ApplyDelta(const std::string& s);
+	
+	// True if the state from the engine is a delta instead of a full state.
+	static bool IsDelta(const std::string& s);
+	
+	// Parses the line "time <bank> <increment> <turn_limit>" which the engine
+	// sends before "go" (see RequestClock) into timeBank etc. Returns false if
+	// it is another line.
+	bool ParseClock(const std::string& line);
 	bool ParseGamePlaybackInitial(const std::string& s);
 	
 	// Loads a map from a text file. The text file contains a description of
@@ -271,11 +972,19 @@ struct Game {
     //    unaffected by the pov switch.
     static int PovSwitch(int pov, int playerID);
 	
-	void DoTimeStep();
+	void DoTimeStep() { DoTimeStep<DefaultMaxPlayers>(); }
+	// Specialized for MaxPlayers (2, 4, 8 or DynamicPlayers). No player
+	// may have a higher id than MaxPlayers, see MaxPlayersFor().
+	template<int MaxPlayers> void DoTimeStep();
+	
+	// Smallest specialization (2, 4, 8 or DynamicPlayers) which supports
+	// the given number of players and all owners in the current state.
+	int MaxPlayersFor(int numPlayers) const;
 	
 	// Parses a string of the form "source_planet destination_planet num_ships"
 	// and calls state.ExecuteOrder. If that fails, the player is dropped.
 	bool ExecuteOrder(int playerID, const std::string& order);
+	bool ExecuteOrder(int playerID, const Order& order);
 	
 	void WriteLogMessage(const std::string& message) {
 		if(logFile) *logFile << message << std::endl;
@@ -293,36 +1002,41 @@ struct Game {
 	// Returns the fleet with the given fleet_id. Fleets are numbered starting
 	// with 0. There are NumFleets() fleets. fleet_id's are not consistent from
 	// one turn to the next.
-	const Fleet& GetFleet(int fleet_id) const {
+	Fleet GetFleet(int fleet_id) const {
 		return state.fleets[fleet_id];
 	}
 	
+	// Returns a view of the planets / fleets whose owner matches the filter.
+	// Unlike the list functions below, this doesn't copy anything.
+	PlanetView ViewPlanets(OwnerFilter filter = OwnerAll) const { return PlanetView(desc, state, filter); }
+	FleetView ViewFleets(OwnerFilter filter = OwnerAll) const { return FleetView(state.fleets, filter); }
+	
 	// Returns a list of all the planets.
-	std::vector<Planet> Planets() const;
+	std::vector<Planet> Planets() const { return ViewPlanets(OwnerAll).ToVector(); }
 	
 	// Return a list of all the planets owned by the current player. By
 	// convention, the current player is always player number 1.
-	std::vector<Planet> MyPlanets() const;
+	std::vector<Planet> MyPlanets() const { return ViewPlanets(OwnerMe).ToVector(); }
 	
 	// Return a list of all neutral planets.
-	std::vector<Planet> NeutralPlanets() const;
+	std::vector<Planet> NeutralPlanets() const { return ViewPlanets(OwnerNeutral).ToVector(); }
 	
 	// Return a list of all the planets owned by rival players. This excludes
 	// planets owned by the current player, as well as neutral planets.
-	std::vector<Planet> EnemyPlanets() const;
+	std::vector<Planet> EnemyPlanets() const { return ViewPlanets(OwnerEnemy).ToVector(); }
 	
 	// Return a list of all the planets that are not owned by the current
 	// player. This includes all enemy planets and neutral planets.
-	std::vector<Planet> NotMyPlanets() const;
+	std::vector<Planet> NotMyPlanets() const { return ViewPlanets(OwnerNotMe).ToVector(); }
 	
 	// Return a list of all the fleets.
-	std::vector<Fleet> Fleets() const;
+	std::vector<Fleet> Fleets() const { return ViewFleets(OwnerAll).ToVector(); }
 	
 	// Return a list of all the fleets owned by the current player.
-	std::vector<Fleet> MyFleets() const;
+	std::vector<Fleet> MyFleets() const { return ViewFleets(OwnerMe).ToVector(); }
 	
 	// Return a list of all the fleets owned by enemy players.
-	std::vector<Fleet> EnemyFleets() const;
+	std::vector<Fleet> EnemyFleets() const { return ViewFleets(OwnerEnemy).ToVector(); }
 	
 	int Winner() const { return state.Winner((maxGameLength >= 0) && (numTurns > maxGameLength)); }
 
@@ -344,7 +1058,90 @@ struct Game {
 	// issuing orders for now.
 	void FinishTurn() const;
 	
+	// Asks the game engine to send deltas instead of full states from the
+	// next turn on. Check for them with IsDelta and use ApplyDelta. Engines
+	// which don't know about deltas just ignore it.
+	void RequestDelta() const;
+	
+	// Tells the game engine that the bot can play several games in a row:
+	// after a game, it gets a line "end" instead of being killed, and then
+	// the first state of the next game. Engines which don't know about it
+	// just ignore it.
+	void RequestMultiGame() const;
+	
+	// Asks the game engine to tell the bot its time every turn, when it plays
+	// with a time bank. The line comes before "go", check for it with
+	// ParseClock. Engines which don't know about it just ignore it.
+	void RequestClock() const;
+	
+	// Asks the game engine to talk over shared memory instead of the pipes,
+	// if it offers that (see shmring.h). Call it during a turn, like the
+	// others; then std::cin and std::cout go through it. Returns whether
+	// they do.
+	bool RequestSharedMemory() const;
+	
+	
+};
+
+// Renders the Point-in-Time text of a state once and then makes the
+// PovRepresentation for each player from it, by patching only the owner
+// fields. The output is exactly the same as the one of the usual
+// std::ostream formatting. Keep one around to reuse its buffers.
+struct PovRenderer {
+	// The text with pov = -1 and where the owner fields are in it.
+	std::string text;
+	struct OwnerField {
+		size_t pos, len;
+		int owner;
+	};
+	std::vector<OwnerField> ownerFields;
+	
+	// "P x y " of every planet, as formatting doubles is slow and the
+	// coordinates usually don't change.
+	struct PlanetPrefix {
+		double x, y;
+		std::string text;
+	};
+	std::vector<PlanetPrefix> planetPrefixes;
+	
+	std::string povText;
+	
+	void Render(const GameDesc& desc, const GameState& state);
+	
+	// Returns the text as player pov sees it, see Game::PovRepresentation.
+	// It is valid until the next call of Pov() or Render().
+	const std::string& Pov(int pov);
+};
+
+// The changes between the states sent in two turns. The engine sends them
+// to bots which asked for it (see Game::RequestDelta) in this format:
+//   D                                 header
+//   C planet owner numShips           a planet which changed
+//   R fleet fleet ...                 fleets of the last turn which are gone,
+//                                     ascending
+//   F owner numShips source ...       a new fleet, like in the full format
+// The other fleets of the last turn are aged by one turn (as in
+// FleetsTimeStep) and the new fleets are appended after them.
+struct GameStateDelta {
+	// The state of the last Update().
+	GameState::Planets lastPlanets;
+	Fleets lastFleets;
+	bool haveLast;
+	
+	// The delta computed by the last Update(), if haveDelta.
+	bool haveDelta;
+	std::vector<int> changedPlanets;
+	std::vector<int> removedFleets;
+	size_t firstNewFleet; // in the current fleets
+	
+	GameStateDelta() : haveLast(false), haveDelta(false), firstNewFleet(0) {}
+	
+	// Computes the delta from the state of the last Update() to this one.
+	void Update(const GameState& state);
 	
+	// Appends the delta as player pov sees it. state must be the one of the
+	// last Update().
+	void Render(const GameState& state, int pov, std::string& out) const;
 };
 
 #endif
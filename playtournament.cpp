@@ -0,0 +1,369 @@
+/*
+ *  playtournament.cpp
+ *  PlanetWars
+ *
+ *  Plays many games between a list of bots, several at once.
+ *  code under GPLv3
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include "engine.h"
+#include "utils.h"
+
+using namespace std;
+
+static const char* progName = "playtournament";
+static std::vector<std::string> mapArgs;
+static std::vector<std::string> bots;
+static std::string pairing = "roundrobin";
+static int numJobs = 0;
+static std::string resultsFilename = "results.txt";
+static PWConfig baseConfig; // of each game
+static bool verbose = false;
+
+static void PrintHelpAndExit() {
+	cerr
+	<< "usage: " << endl
+	<< "  " << progName << " [-m <map_dir_or_glob>]... [-p roundrobin|gauntlet] "
+	<< "[-j <num_games_at_once>] [-o <results_file>] "
+	<< "[-t <turn_time>] [-ft <first_turn_time>] [-n <num_turns>] [-cpu] [-shm] "
+	<< "[-bank <time_bank> [-inc <increment>] [-overdraft <overdraft>]] [-v] [--] "
+	<< "<bot_one> <bot_two> [more_bots]" << endl
+	<< "with default values:" << endl
+	<< "  map = maps (all *.txt in it)" << endl
+	<< "  pairing = roundrobin = every bot against every other one" << endl
+	<< "    gauntlet = bot_one against every other one" << endl
+	<< "  num_games_at_once = number of CPUs" << endl
+	<< "  results_file = results.txt" << endl
+	<< "  turn_time, first_turn_time, num_turns, time_bank, increment," << endl
+	<< "    overdraft as in playgame" << endl
+	<< "Every pair plays on every map once from each side. Bots which" << endl
+	<< "speak the multi-game protocol are kept running between games." << endl
+	<< "-cpu : the turn times are CPU time, as in playgame" << endl
+	<< "-shm : offer the bots shared memory, as in playgame" << endl
+	<< "-v : show the output of the games" << endl
+	<< "or" << endl
+	<< "  " << progName << " -h : this help" << endl
+	;
+	_exit(0);
+}
+
+static void ParseParams(int argc, char** argv) {
+	for(int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if(arg == "--") {
+			for(++i; i < argc; ++i) bots.push_back(argv[i]);
+			break;
+		}
+		else if(arg.size() <= 1 || arg[0] != '-')
+			bots.push_back(arg);
+		else if(arg == "-v")
+			verbose = true;
+		else if(arg == "-cpu")
+			baseConfig.cpuTimeLimits = true;
+		else if(arg == "-shm")
+			baseConfig.sharedMemory = true;
+		else if(arg == "-h")
+			PrintHelpAndExit();
+		else {
+			++i;
+			if(i >= argc) {
+				cerr << arg << " expecting option or invalid" << endl;
+				PrintHelpAndExit();
+			}
+			if(arg == "-m")
+				mapArgs.push_back(argv[i]);
+			else if(arg == "-p")
+				pairing = argv[i];
+			else if(arg == "-j")
+				numJobs = atoi(argv[i]);
+			else if(arg == "-o")
+				resultsFilename = argv[i];
+			else if(arg == "-t")
+				baseConfig.maxTurnTime = atol(argv[i])*1000;
+			else if(arg == "-ft")
+				baseConfig.maxFirstTurnTime = atol(argv[i])*1000;
+			else if(arg == "-n")
+				baseConfig.maxNumTurns = atoi(argv[i]);
+			else if(arg == "-bank")
+				baseConfig.timeBank = (long)(atof(argv[i])*1000);
+			else if(arg == "-inc")
+				baseConfig.timeIncrement = (long)(atof(argv[i])*1000);
+			else if(arg == "-overdraft")
+				baseConfig.timeOverdraft = (long)(atof(argv[i])*1000);
+			else {
+				cerr << "don't understand option: " << arg << endl;
+				PrintHelpAndExit();
+			}
+		}
+	}
+
+	if(bots.size() < 2) {
+		cerr << "you need at least 2 bots" << endl;
+		PrintHelpAndExit();
+	}
+	if(pairing != "roundrobin" && pairing != "gauntlet") {
+		cerr << "unknown pairing: " << pairing << endl;
+		PrintHelpAndExit();
+	}
+	if(mapArgs.empty())
+		mapArgs.push_back("maps");
+	if(numJobs <= 0)
+		numJobs = std::max((int)sysconf(_SC_NPROCESSORS_ONLN), 1);
+}
+
+// A directory stands for all *.txt files in it, anything else is a glob.
+static std::vector<std::string> ExpandMaps() {
+	std::vector<std::string> maps;
+	for(size_t i = 0; i < mapArgs.size(); ++i) {
+		std::string pattern = mapArgs[i];
+		struct stat st;
+		if(stat(pattern.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+			pattern += "/*.txt";
+		glob_t g;
+		if(glob(pattern.c_str(), 0, NULL, &g) == 0) {
+			for(size_t j = 0; j < g.gl_pathc; ++j)
+				maps.push_back(g.gl_pathv[j]);
+		}
+		else
+			cerr << "WARNING: no maps found for " << mapArgs[i] << endl;
+		globfree(&g);
+	}
+	return maps;
+}
+
+struct Match {
+	std::string map;
+	int player1, player2; // index into bots
+	Match(const std::string& m, int p1, int p2) : map(m), player1(p1), player2(p2) {}
+};
+
+static std::vector<Match> Schedule(const std::vector<std::string>& maps) {
+	std::vector<Match> matches;
+	for(size_t m = 0; m < maps.size(); ++m)
+		for(int i = 0; i < (int)bots.size(); ++i)
+			for(int j = i + 1; j < (int)bots.size(); ++j) {
+				if(pairing == "gauntlet" && i > 0) continue;
+				matches.push_back(Match(maps[m], i, j));
+				matches.push_back(Match(maps[m], j, i));
+			}
+	return matches;
+}
+
+// Plays the game and returns the result line.
+static std::string PlayMatch(const Match& match, PWProcessPool& pool) {
+	PWConfig config = baseConfig;
+	config.mapFilename = match.map;
+	config.replayStream = NULL;
+	config.beQuiet = true;
+	config.playerCommands.push_back(bots[match.player1]);
+	config.playerCommands.push_back(bots[match.player2]);
+	config.processPool = &pool;
+
+	std::string line = match.map + "\t" + to_string(match.player1 + 1) + "\t" + to_string(match.player2 + 1) + "\t";
+	PWMatch game(config);
+	PWMatchResult result;
+	if(game.Start() && game.Play(PWMainloopCallbacks(), &result)) {
+		line += to_string(result.winner) + "\t" + to_string(result.numTurns);
+		for(size_t i = 0; i < result.avgResponseTime.size(); ++i)
+			line += "\t" + to_string(result.avgResponseTime[i]) + "\t" + to_string(result.maxResponseTime[i]);
+		for(size_t i = 0; i < result.cpuTime.size(); ++i)
+			line += "\t" + to_string(result.cpuTime[i]) + "\t" + to_string(result.maxRss[i]);
+	}
+	else
+		line += "-1\t0";
+	return line + "\n";
+}
+
+// A forked process which plays one game after another. It gets the index
+// of the next match through jobFd and sends back the result line. Its bot
+// processes are kept in its pool between the games.
+struct Worker {
+	pid_t pid;
+	int jobFd, resultFd;
+	int match; // the one it plays, -1 if idle
+	Worker() : pid(0), jobFd(-1), resultFd(-1), match(-1) {}
+};
+
+static void RunWorker(const std::vector<Match>& matches, int jobFd, int resultFd) {
+	if(!verbose) {
+		int devNull = open("/dev/null", O_WRONLY);
+		dup2(devNull, STDERR_FILENO);
+		close(devNull);
+	}
+	FILE* jobs = fdopen(jobFd, "r");
+	{
+		PWProcessPool pool;
+		char buf[64];
+		while(fgets(buf, sizeof(buf), jobs)) {
+			const std::string line = PlayMatch(matches[atoi(buf)], pool);
+			// It is shorter than PIPE_BUF, so it arrives at once.
+			if(write(resultFd, line.c_str(), line.size()) < 0) break;
+		}
+	}
+	_exit(0);
+}
+
+static bool StartWorker(const std::vector<Match>& matches, std::vector<Worker>& workers, size_t w) {
+	int jobPipe[2], resultPipe[2];
+	if(pipe(jobPipe) != 0 || pipe(resultPipe) != 0) {
+		cerr << "ERROR: cannot create pipe: " << strerror(errno) << endl;
+		return false;
+	}
+	// The bots don't need them.
+	fcntl(jobPipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(jobPipe[1], F_SETFD, FD_CLOEXEC);
+	fcntl(resultPipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(resultPipe[1], F_SETFD, FD_CLOEXEC);
+
+	pid_t p = fork();
+	if(p < 0) {
+		cerr << "ERROR: cannot fork: " << strerror(errno) << endl;
+		return false;
+	}
+	if(p == 0) {
+		// Otherwise the other workers don't see EOF when we quit.
+		for(size_t i = 0; i < workers.size(); ++i) {
+			if(workers[i].jobFd >= 0) close(workers[i].jobFd);
+			if(workers[i].resultFd >= 0) close(workers[i].resultFd);
+		}
+		close(jobPipe[1]);
+		close(resultPipe[0]);
+		RunWorker(matches, jobPipe[0], resultPipe[1]);
+	}
+	close(jobPipe[0]);
+	close(resultPipe[1]);
+	workers[w].pid = p;
+	workers[w].jobFd = jobPipe[1];
+	workers[w].resultFd = resultPipe[0];
+	workers[w].match = -1;
+	return true;
+}
+
+static void StopWorker(Worker& worker) {
+	close(worker.jobFd);
+	close(worker.resultFd);
+	waitpid(worker.pid, NULL, 0);
+	worker = Worker();
+}
+
+// Wins, draws, losses of one bot.
+struct Score {
+	int wins, draws, losses;
+	Score() : wins(0), draws(0), losses(0) {}
+};
+
+int main(int argc, char** argv) {
+	progName = argv[0];
+	ParseParams(argc, argv);
+
+	const std::vector<Match> matches = Schedule(ExpandMaps());
+	if(matches.empty()) {
+		cerr << "ERROR: nothing to play" << endl;
+		return 1;
+	}
+
+	std::ofstream results(resultsFilename.c_str());
+	if(!results) {
+		cerr << "ERROR: cannot write " << resultsFilename << endl;
+		return 1;
+	}
+	results << "# bots:";
+	for(size_t i = 0; i < bots.size(); ++i)
+		results << " " << (i + 1) << "=" << bots[i];
+	results << endl;
+	results << "# map\tplayer1\tplayer2\twinner\tturns\tavg_ms1\tmax_ms1\tavg_ms2\tmax_ms2\tcpu_ms1\trss_kb1\tcpu_ms2\trss_kb2" << endl;
+
+	// The games run in numJobs worker processes (so that a game can't take
+	// the others down). Whenever one is done, it gets the next game, so all
+	// of them stay busy until the end.
+	std::vector<Worker> workers(std::min((size_t)numJobs, matches.size()));
+	for(size_t w = 0; w < workers.size(); ++w)
+		if(!StartWorker(matches, workers, w)) return 1;
+
+	size_t nextMatch = 0, numFinished = 0;
+	std::vector<Score> scores(bots.size());
+	std::vector<pollfd> fds;
+	std::vector<size_t> fdWorkers;
+	long startTime = currentTimeMillis();
+	while(numFinished < matches.size()) {
+		for(size_t w = 0; w < workers.size(); ++w) {
+			if(workers[w].match >= 0 || nextMatch >= matches.size()) continue;
+			if(workers[w].pid == 0 && !StartWorker(matches, workers, w)) return 1;
+			const std::string job = to_string(nextMatch) + "\n";
+			if(write(workers[w].jobFd, job.c_str(), job.size()) < 0) {
+				cerr << "ERROR: cannot write to worker: " << strerror(errno) << endl;
+				return 1;
+			}
+			workers[w].match = (int)nextMatch++;
+		}
+
+		fds.clear();
+		fdWorkers.clear();
+		for(size_t w = 0; w < workers.size(); ++w) {
+			if(workers[w].match < 0) continue;
+			pollfd fd = { workers[w].resultFd, POLLIN, 0 };
+			fds.push_back(fd);
+			fdWorkers.push_back(w);
+		}
+		if(poll(&fds[0], fds.size(), -1) < 0) {
+			if(errno == EINTR) continue;
+			cerr << "ERROR: poll: " << strerror(errno) << endl;
+			return 1;
+		}
+
+		for(size_t f = 0; f < fds.size(); ++f) {
+			if(!fds[f].revents) continue;
+			Worker& worker = workers[fdWorkers[f]];
+			const Match& match = matches[worker.match];
+			char buf[1024];
+			ssize_t n = read(worker.resultFd, buf, sizeof(buf));
+			std::string line;
+			if(n > 0)
+				line = std::string(buf, n);
+			else { // crashed, it is started again for the next game
+				line = match.map + "\t" + to_string(match.player1 + 1) + "\t" + to_string(match.player2 + 1) + "\t-1\t0\n";
+				StopWorker(worker);
+			}
+			worker.match = -1;
+			results << line << std::flush;
+
+			std::vector<std::string> fields = Tokenize(line, "\t\n");
+			const int winner = (fields.size() > 3) ? atoi(fields[3].c_str()) : -1;
+			if(winner == 0) {
+				scores[match.player1].draws++;
+				scores[match.player2].draws++;
+			}
+			else if(winner == 1 || winner == 2) {
+				scores[(winner == 1) ? match.player1 : match.player2].wins++;
+				scores[(winner == 1) ? match.player2 : match.player1].losses++;
+			}
+			++numFinished;
+			cerr << "\r" << numFinished << "/" << matches.size() << " games" << std::flush;
+		}
+	}
+	cerr << " in " << (currentTimeMillis() - startTime) / 1000.0 << " s" << endl;
+
+	for(size_t w = 0; w < workers.size(); ++w)
+		if(workers[w].pid) StopWorker(workers[w]);
+
+	for(size_t i = 0; i < bots.size(); ++i)
+		cout << scores[i].wins << " wins, " << scores[i].draws << " draws, "
+		<< scores[i].losses << " losses: " << bots[i] << endl;
+	return 0;
+}
@@ -13,125 +13,628 @@
 #include <vector>
 #include <string>
 #include <stdio.h> // strerror etc
-#include <unistd.h> // pipe, fork, etc
+#include <unistd.h> // pipe, etc
+#include <spawn.h>
 #include <errno.h>
 #include <signal.h> // kill etc
 #include <fcntl.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <sys/time.h>
 #include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <algorithm>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#endif
 #include "process.h"
+#include "shmring.h"
 #include "utils.h"
 
+extern char** environ;
+
+// Both ends are close-on-exec, so that they don't leak into other clients.
+static bool makePipe(int fds[2]) {
+#ifdef __linux__
+	return pipe2(fds, O_CLOEXEC) == 0;
+#else
+	if(pipe(fds) != 0) return false;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	return true;
+#endif
+}
+
+static long long currentTimeMicros() {
+	timeval t;
+	gettimeofday(&t, NULL);
+	return (long long)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+#ifdef __linux__
+// Moves an fd above the ones the bot gets (ShmBotMemFd etc.), so that the
+// dup2s for the bot don't overwrite it.
+static int highFd(int fd) {
+	if(fd < 0 || fd >= 10) return fd;
+	const int high = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+	close(fd);
+	return high;
+}
+
+// Maps the rings and makes the eventfds. Returns the memfd for the bot, or
+// -1 if that doesn't work.
+static int createSharedMemory(Process& p) {
+	const int memFd = highFd(memfd_create("planetwars", MFD_CLOEXEC));
+	p.shmWakeFd = highFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+	p.shmBotWakeFd = highFd(eventfd(0, EFD_CLOEXEC));
+	void* area = MAP_FAILED;
+	if(memFd >= 0 && ftruncate(memFd, sizeof(ShmArea)) == 0)
+		area = mmap(NULL, sizeof(ShmArea), PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+	if(area == MAP_FAILED || p.shmWakeFd < 0 || p.shmBotWakeFd < 0) {
+		std::cerr << "WARNING: no shared memory for '" << p.cmd << "': " << strerror(errno) << std::endl;
+		if(memFd >= 0) close(memFd);
+		p.closeSharedMemory();
+		return -1;
+	}
+	p.shm = (ShmArea*)area;
+	return memFd;
+}
+
+bool Process::useSharedMemory() {
+	if(!shm) return false;
+	shmActive = true;
+	return true;
+}
+
+void Process::closeSharedMemory() {
+	if(shm) munmap(shm, sizeof(ShmArea));
+	if(shmWakeFd >= 0) close(shmWakeFd);
+	if(shmBotWakeFd >= 0) close(shmBotWakeFd);
+	shm = NULL;
+	shmActive = false;
+	shmWakeFd = shmBotWakeFd = -1;
+}
+#else
+static int createSharedMemory(Process& p) { return -1; }
+bool Process::useSharedMemory() { return false; }
+void Process::closeSharedMemory() {}
+#endif
+
 void Process::run() {
 	using namespace std;
 	
 	int pipe_mainToFork[2];	// 0: read from, 1: write to
-	if(pipe(pipe_mainToFork) != 0) { // error creating pipe
+	if(!makePipe(pipe_mainToFork)) { // error creating pipe
 		cerr << "Process::run(): cannot create first pipe: " << strerror(errno) << endl;		
 		return;
 	}
 	
 	int pipe_forkToMain[2];	// 0: read from, 1: write to
-	if(pipe(pipe_forkToMain) != 0) { // error creating pipe
+	if(!makePipe(pipe_forkToMain)) { // error creating pipe
 		cerr << "Process::run(): cannot create second pipe: " << strerror(errno) << endl;		
+		close(pipe_mainToFork[0]);
+		close(pipe_mainToFork[1]);
 		return;
 	}	
 	
-	pid_t p = fork();
-	if(p < 0) { // error forking
-		cerr << "Process::run(): cannot fork: " << strerror(errno) << endl;		
-		return;
+	std::vector<std::string> paramsS = Tokenize(cmd, " ");
+	if(paramsS.size() == 0) paramsS.push_back("");
+	std::vector<char*> params(paramsS.size() + 1, (char*)NULL);
+	for(size_t i = 0; i < paramsS.size(); ++i)
+		params[i] = (char*)paramsS[i].c_str();
+	
+	// posix_spawn doesn't copy our memory like fork (which is slow with a
+	// big engine process, e.g. with the viewer), and it reports when the
+	// program can't be run. dup2 clears close-on-exec for stdin/stdout.
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, pipe_mainToFork[0], STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, pipe_forkToMain[1], STDOUT_FILENO);
+	
+	// The engine ignores SIGPIPE, and ignored signals stay ignored across
+	// exec. The bot gets the default, as if it was started from a shell.
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	sigset_t sigDefault;
+	sigemptyset(&sigDefault);
+	sigaddset(&sigDefault, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigDefault);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+	
+	// The shared memory goes to fixed fds, which the environment tells.
+	const int shmMemFd = offerSharedMemory ? createSharedMemory(*this) : -1;
+	std::vector<char*> env;
+	std::string shmEnv;
+	if(shmMemFd >= 0) {
+		posix_spawn_file_actions_adddup2(&actions, shmMemFd, ShmBotMemFd);
+		posix_spawn_file_actions_adddup2(&actions, shmBotWakeFd, ShmBotWakeFd);
+		posix_spawn_file_actions_adddup2(&actions, shmWakeFd, ShmBotEngineWakeFd);
+		shmEnv = std::string(PW_SHM_ENV) + "=" + to_string((int)ShmBotMemFd) + " " +
+			to_string((int)ShmBotWakeFd) + " " + to_string((int)ShmBotEngineWakeFd);
+		for(char** e = environ; *e; ++e)
+			if(strncmp(*e, PW_SHM_ENV "=", sizeof(PW_SHM_ENV)) != 0) env.push_back(*e);
+		env.push_back((char*)shmEnv.c_str());
+		env.push_back(NULL);
 	}
-	else if(p == 0) { // fork		
-		// close other ends of pipes
+	
+	const long long startTime = currentTimeMicros();
+	pid_t p = 0;
+	const int err = posix_spawnp(&p, params[0], &actions, &attr, &params[0], env.empty() ? environ : &env[0]);
+	spawnTime = currentTimeMicros() - startTime;
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	
+	// close other ends
+	close(pipe_mainToFork[0]);
+	close(pipe_forkToMain[1]);
+	if(shmMemFd >= 0) close(shmMemFd); // the mapping stays
+	
+	if(err != 0) {
+		cerr << "ERROR: cannot run '" << cmd << "': " << strerror(err) << endl;
 		close(pipe_mainToFork[1]);
 		close(pipe_forkToMain[0]);
-		
-		// redirect stdin/stdout to our pipes
-		dup2(pipe_mainToFork[0], STDIN_FILENO);
-		dup2(pipe_forkToMain[1], STDOUT_FILENO);
-		
-		// run
-		std::vector<std::string> paramsS = Tokenize(cmd, " ");
-		if(paramsS.size() == 0) paramsS.push_back("");
-		char** params = new char*[paramsS.size() + 1];
-		for(size_t i = 0; i < paramsS.size(); ++i)
-			params[i] = (char*)paramsS[i].c_str();
-		params[paramsS.size()] = NULL;
-		execvp(params[0], params);
-		cerr << "ERROR: cannot run '" << cmd << "': " << strerror(errno) << endl;
-		_exit(0);
-	}
-	else { // parent
-		   // close other ends
-		close(pipe_mainToFork[0]);
-		close(pipe_forkToMain[1]);
-		
-		forkId = p;
-		running = true;
-		forkInputFd = pipe_mainToFork[1];
-		forkOutputFd = pipe_forkToMain[0];
-		
-		// we don't want blocking on the fork output reading
-		fcntl(forkOutputFd, F_SETFL, O_NONBLOCK);
+		closeSharedMemory();
+		return;
 	}
+	
+	forkId = p;
+	running = true;
+	forkInputFd = pipe_mainToFork[1];
+	forkOutputFd = pipe_forkToMain[0];
+	
+	// we don't want blocking on the fork output reading, nor on writing
+	// to a fork which doesn't read its input
+	fcntl(forkOutputFd, F_SETFL, O_NONBLOCK);
+	fcntl(forkInputFd, F_SETFL, O_NONBLOCK);
 }
 
+bool Process::hasExited() {
+	if(!running) return true;
+	if(waitpid(forkId, NULL, WNOHANG) != forkId) return false;
+	running = false; // so we don't kill some other process with that pid
+	return true;
+}
+
+#ifdef __linux__
+bool Process::readUsage(long& cpuTime, long& maxRss) const {
+	if(!running) return false;
+	char path[64];
+	char buf[4096];
+	
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)forkId);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) return false;
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(n <= 0) return false;
+	buf[n] = 0;
+	// The command name in parentheses may contain anything, so count the
+	// fields after its end. utime is field 14, stime, cutime, cstime follow.
+	const char* p = strrchr(buf, ')');
+	if(!p) return false;
+	unsigned long utime, stime;
+	long cutime, cstime;
+	if(sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld",
+			  &utime, &stime, &cutime, &cstime) != 4)
+		return false;
+	static const long ticksPerSec = sysconf(_SC_CLK_TCK);
+	cpuTime = (long)((utime + stime + cutime + cstime) * 1000 / ticksPerSec);
+	
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)forkId);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) return true;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(n <= 0) return true;
+	buf[n] = 0;
+	const char* hwm = strstr(buf, "VmHWM:");
+	if(hwm) maxRss = atol(hwm + 6);
+	return true;
+}
+#else
+bool Process::readUsage(long& cpuTime, long& maxRss) const {
+	return false;
+}
+#endif
+
 void Process::destroy() {
 	if(running) {
 		kill(forkId, SIGTERM);
 	}
 }
 
+// How long a process gets to exit after SIGTERM before it is killed.
+static const int TerminateTimeout = 100; // ms
+
+Process::~Process() {
+	if(running) {
+		kill(forkId, SIGTERM);
+		bool gone = false;
+		for(int t = 0; !gone; ++t) {
+			const pid_t r = waitpid(forkId, NULL, WNOHANG);
+			gone = (r == forkId || (r < 0 && errno != EINTR));
+			if(!gone && t >= TerminateTimeout) {
+				kill(forkId, SIGKILL);
+				while(waitpid(forkId, NULL, 0) < 0 && errno == EINTR) {}
+				gone = true;
+			}
+			if(!gone) usleep(1000);
+		}
+	}
+	if(forkInputFd > 0) close(forkInputFd);
+	if(forkOutputFd > 0) close(forkOutputFd);
+	closeSharedMemory();
+}
+
 void Process::waitForExit() {
 	if(running) {
 		waitpid(forkId, NULL, 0);
 		close(forkInputFd);
 		close(forkOutputFd);
+		closeSharedMemory();
 		*this = Process(); // reset
 	}	
 }
 
-static timeval millisecsToTimeval(size_t ms) {
-	timeval v;
-	v.tv_sec = ms / 1000;
-	v.tv_usec = (ms % 1000) * 1000;
-	return v;
+bool Process::hasLine() const {
+	return memchr(outbuffer.data() + outbufferPos, '\n', outbuffer.size() - outbufferPos) != NULL;
 }
 
-bool Process::readLine(std::string& s, size_t timeout) {
+// Takes the next complete line out of outbuffer.
+static bool takeLine(Process& p, const char*& line, size_t& len) {
+	const char* start = p.outbuffer.data() + p.outbufferPos;
+	const char* end = (const char*)memchr(start, '\n', p.outbuffer.size() - p.outbufferPos);
+	if(!end) return false;
+	line = start;
+	len = end - start;
+	p.outbufferPos += len + 1;
+	return true;
+}
+
+static const size_t ReadChunkSize = 4096;
+
+#ifdef __linux__
+// Like read() on the output pipe, but from the ring. The pipe only tells us
+// that the bot is gone.
+static ssize_t readSharedMemory(Process& p, char* buf, size_t len) {
+	ShmRing& ring = p.shm->toEngine;
+	size_t n = ring.Read(buf, len);
+	if(n == 0) {
+		// The wakeup is used up when we reset it, so we also do what else it
+		// could have been for (room for our input) and then look again.
+		ShmClearWakeup(p.shmWakeFd);
+		if(p.hasPendingInput()) p.flushSome();
+		n = ring.Read(buf, len);
+	}
+	if(n > 0) {
+		// We are awake and read until the ring is empty, see waitForSharedMemory.
+		if(ring.readerWaiting) ring.SetReaderWaiting(false);
+		if(ring.WriterWaits()) ShmWake(p.shmBotWakeFd);
+		return n;
+	}
+	char c;
+	if(read(p.forkOutputFd, &c, 1) == 0) return 0; // EOF
+	errno = EAGAIN;
+	return -1;
+}
+
+// Whether the bot wrote something or made room for our pending input.
+static bool sharedMemoryReady(const Process& p) {
+	return p.shm->toEngine.Used() > 0 ||
+		(p.hasPendingInput() && p.shm->toBot.Used() < (size_t)ShmRing::Size);
+}
+
+// Before sleeping on the wakeup eventfds of the processes ids: polls their
+// rings for a while, then asks them to wake us up and looks once more.
+// Returns whether some are ready, and adds their ids to ready if given; we
+// sleep only if there are none.
+static bool waitForSharedMemory(Process* const* processes, const int* ids, size_t numIds,
+								std::vector<int>* ready) {
+	bool any = false;
+	for(int spin = ShmSpinHelps() ? ShmSpinIterations : 0; !any; --spin) {
+		for(size_t i = 0; i < numIds; ++i) {
+			if(!sharedMemoryReady(*processes[ids[i]])) continue;
+			any = true;
+			if(ready) ready->push_back(ids[i]);
+		}
+		if(spin <= 0) break;
+		ShmPause();
+	}
+	for(size_t i = 0; i < numIds && !any; ++i) {
+		processes[ids[i]]->shm->toEngine.SetReaderWaiting(true);
+		if(!sharedMemoryReady(*processes[ids[i]])) continue;
+		any = true;
+		if(ready) ready->push_back(ids[i]);
+	}
+	return any;
+}
+#else
+static ssize_t readSharedMemory(Process& p, char* buf, size_t len) { return 0; }
+#endif
+
+bool Process::readLine(const char*& line, size_t& len, size_t timeout) {
 	size_t startTime = (size_t)currentTimeMillis();
 	
-	fd_set fdset;
-	FD_ZERO(&fdset);
-	FD_SET(forkOutputFd, &fdset);
+	pollfd fd;
+	fd.fd = shmActive ? shmWakeFd : forkOutputFd;
+	fd.events = POLLIN;
 	
 	while(true) {
-		char c;
-		while(read(forkOutputFd, &c, 1) > 0) {
-			if(c == '\n') {
-				s = outbuffer;
-				outbuffer = "";
-				return true;
-			}
-			outbuffer += c;
+		if(takeLine(*this, line, len)) return true;
+		if(outputEOF) return false;
+		
+		// Only an incomplete line is left, and lines returned earlier may go now.
+		outbuffer.erase(0, outbufferPos);
+		outbufferPos = 0;
+		const size_t oldSize = outbuffer.size();
+		outbuffer.resize(oldSize + ReadChunkSize);
+		ssize_t r = shmActive ?
+			readSharedMemory(*this, &outbuffer[oldSize], ReadChunkSize) :
+			read(forkOutputFd, &outbuffer[oldSize], ReadChunkSize);
+		outbuffer.resize(oldSize + ((r > 0) ? r : 0));
+		if(r > 0) continue;
+		if(r == 0) { // EOF
+			outputEOF = true;
+			return false;
 		}
 		
 		size_t dt = currentTimeMillis() - startTime;
 		if((size_t)dt > timeout) return false;
-		timeval t = millisecsToTimeval(timeout - dt);
 		
-		if(select(FD_SETSIZE, &fdset, NULL, NULL, &t) <= 0) // timeout or error
-			return false;		
+#ifdef __linux__
+		if(shmActive && timeout > 0) {
+			Process* self = this;
+			const int id = 0;
+			if(waitForSharedMemory(&self, &id, 1, NULL)) continue;
+		}
+#endif
+		if(poll(&fd, 1, (int)std::min(timeout - dt, (size_t)INT_MAX)) <= 0) // timeout or error
+			return false;
 	}
 	return false;
 }
 
+bool Process::readLine(std::string& s, size_t timeout) {
+	const char* line;
+	size_t len;
+	if(!readLine(line, len, timeout)) return false;
+	s.assign(line, len);
+	return true;
+}
+
+#ifdef __linux__
+
+ProcessPoller::ProcessPoller() : epollFd(epoll_create(16)) {
+	if(epollFd < 0)
+		std::cerr << "ProcessPoller: cannot create epoll: " << strerror(errno) << std::endl;
+}
+
+ProcessPoller::~ProcessPoller() {
+	if(epollFd >= 0) close(epollFd);
+}
+
+void ProcessPoller::Add(int id, Process* p) {
+	if((size_t)id >= processes.size()) {
+		processes.resize(id + 1, NULL);
+		watchingInput.resize(id + 1, false);
+		watchingShm.resize(id + 1, false);
+	}
+	if(processes[id]) Remove(id);
+	processes[id] = p;
+	epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = id;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, p->forkOutputFd, &ev);
+	if(p->shmActive)
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, p->shmWakeFd, &ev);
+	watchingShm[id] = p->shmActive;
+	Update(id);
+}
+
+void ProcessPoller::Remove(int id) {
+	if((size_t)id >= processes.size() || !processes[id]) return;
+	epoll_event ev; // needed by old kernels
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, processes[id]->forkOutputFd, &ev);
+	if(watchingInput[id])
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, processes[id]->forkInputFd, &ev);
+	if(watchingShm[id])
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, processes[id]->shmWakeFd, &ev);
+	watchingInput[id] = false;
+	watchingShm[id] = false;
+	processes[id] = NULL;
+}
+
+void ProcessPoller::Update(int id) {
+	if((size_t)id >= processes.size() || !processes[id]) return;
+	// With shared memory, the wakeup eventfd also tells about room for it.
+	const bool watch = processes[id]->hasPendingInput() && !watchingShm[id];
+	if(watch == (bool)watchingInput[id]) return;
+	epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLOUT;
+	ev.data.u32 = id;
+	epoll_ctl(epollFd, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, processes[id]->forkInputFd, &ev);
+	watchingInput[id] = watch;
+}
+
+bool ProcessPoller::Wait(std::vector<int>& ready, size_t timeout) {
+	ready.clear();
+	readyBuffer.clear();
+	for(size_t id = 0; id < processes.size(); ++id)
+		if(watchingShm[id]) readyBuffer.push_back(id);
+	if(!readyBuffer.empty() && waitForSharedMemory(&processes[0], &readyBuffer[0], readyBuffer.size(), &ready))
+		return true;
+	epoll_event events[16];
+	int n;
+	do n = epoll_wait(epollFd, events, 16, (int)std::min(timeout, (size_t)INT_MAX));
+	while(n < 0 && errno == EINTR);
+	for(int i = 0; i < n; ++i)
+		ready.push_back(events[i].data.u32);
+	return n > 0;
+}
+
+#else
+
+ProcessPoller::ProcessPoller() : epollFd(-1) {}
+ProcessPoller::~ProcessPoller() {}
+
+void ProcessPoller::Add(int id, Process* p) {
+	if((size_t)id >= processes.size()) processes.resize(id + 1, NULL);
+	processes[id] = p;
+}
+
+void ProcessPoller::Remove(int id) {
+	if((size_t)id < processes.size()) processes[id] = NULL;
+}
+
+void ProcessPoller::Update(int id) {}
+
+bool ProcessPoller::Wait(std::vector<int>& ready, size_t timeout) {
+	ready.clear();
+	std::vector<pollfd> fds;
+	readyBuffer.clear();
+	for(size_t id = 0; id < processes.size(); ++id) {
+		if(!processes[id]) continue;
+		pollfd fd = { processes[id]->forkOutputFd, POLLIN, 0 };
+		fds.push_back(fd);
+		readyBuffer.push_back(id);
+		if(processes[id]->hasPendingInput()) {
+			pollfd fd = { processes[id]->forkInputFd, POLLOUT, 0 };
+			fds.push_back(fd);
+			readyBuffer.push_back(id);
+		}
+	}
+	int n;
+	do n = poll(fds.empty() ? NULL : &fds[0], fds.size(), (int)std::min(timeout, (size_t)INT_MAX));
+	while(n < 0 && errno == EINTR);
+	for(size_t i = 0; n > 0 && i < fds.size(); ++i)
+		if(fds[i].revents) ready.push_back(readyBuffer[i]);
+	return n > 0;
+}
+
+#endif
+
+static const size_t MaxWriteParts = 4;
+
+#ifdef __linux__
+// Like writeParts and flushSome, into the ring. The parts are copied only
+// once, unless the ring is full.
+static void writeSharedMemory(Process& p, const std::string* parts, size_t numParts) {
+	ShmRing& ring = p.shm->toBot;
+	size_t written = 0;
+	for(int tries = 0; tries < 2; ++tries) {
+		if(!p.inbuffer.empty()) {
+			const size_t n = ring.Write(p.inbuffer.data(), p.inbuffer.size());
+			p.inbuffer.erase(0, n);
+			written += n;
+		}
+		for(size_t i = 0; i < numParts; ++i) {
+			const size_t n = p.inbuffer.empty() ? ring.Write(parts[i].data(), parts[i].size()) : 0;
+			written += n;
+			if(n < parts[i].size()) p.inbuffer.append(parts[i], n, std::string::npos);
+		}
+		numParts = 0;
+		// If it doesn't fit, the bot wakes us up when it made room.
+		ring.SetWriterWaiting(!p.inbuffer.empty());
+		if(p.inbuffer.empty() || ring.Used() == ShmRing::Size) break;
+	}
+	if(written > 0 && ring.ReaderWaits()) ShmWake(p.shmBotWakeFd);
+}
+#else
+static void writeSharedMemory(Process& p, const std::string* parts, size_t numParts) {}
+#endif
+
+bool Process::writeParts(const std::string* parts, size_t numParts) {
+	if(shmActive) {
+		writeSharedMemory(*this, parts, numParts);
+		return true;
+	}
+	if(numParts > MaxWriteParts) {
+		for(size_t i = 0; i < numParts; ++i) inbuffer += parts[i];
+		return flushSome();
+	}
+	
+	iovec iov[MaxWriteParts + 1];
+	int n = 0;
+	if(!inbuffer.empty()) {
+		iov[n].iov_base = &inbuffer[0];
+		iov[n++].iov_len = inbuffer.size();
+	}
+	for(size_t i = 0; i < numParts; ++i) {
+		if(parts[i].empty()) continue;
+		iov[n].iov_base = (void*)parts[i].data();
+		iov[n++].iov_len = parts[i].size();
+	}
+	if(n == 0) return true;
+	
+	ssize_t r;
+	do r = writev(forkInputFd, iov, n);
+	while(r < 0 && errno == EINTR);
+	if(r < 0) {
+		if(errno != EAGAIN && errno != EWOULDBLOCK) {
+			inbuffer = "";
+			return false;
+		}
+		r = 0;
+	}
+	
+	// Keep what didn't fit.
+	size_t written = r;
+	if(written >= inbuffer.size()) {
+		written -= inbuffer.size();
+		inbuffer = "";
+	}
+	else {
+		inbuffer.erase(0, written);
+		written = 0;
+	}
+	for(size_t i = 0; i < numParts; ++i) {
+		if(written >= parts[i].size())
+			written -= parts[i].size();
+		else {
+			inbuffer.append(parts[i], written, std::string::npos);
+			written = 0;
+		}
+	}
+	return true;
+}
+
+bool Process::flushSome() {
+	if(shmActive) {
+		writeSharedMemory(*this, NULL, 0);
+		return true;
+	}
+	while(!inbuffer.empty()) {
+		ssize_t r = write(forkInputFd, inbuffer.data(), inbuffer.size());
+		if(r < 0) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return true;
+			inbuffer = "";
+			return false;
+		}
+		inbuffer.erase(0, r);
+	}
+	return true;
+}
+
 void Process::flush() {
-	size_t n = 0;
-	while(n < inbuffer.size())
-		n += write(forkInputFd, inbuffer.c_str() + n, inbuffer.size() - n);
-	inbuffer = "";
+	while(flushSome() && !inbuffer.empty()) {
+		if(shmActive) {
+			// Until the bot makes room or is gone.
+			pollfd fds[2] = { { shmWakeFd, POLLIN, 0 }, { forkOutputFd, POLLIN, 0 } };
+			poll(fds, 2, -1);
+			if(fds[1].revents) break;
+			ShmClearWakeup(shmWakeFd);
+			continue;
+		}
+		pollfd fd = { forkInputFd, POLLOUT, 0 };
+		poll(&fd, 1, -1);
+	}
 }
 
 #endif // not _WIN32
@@ -11,6 +11,7 @@
 #define __PW__PROCESS_H__
 
 #include <string>
+#include <vector>
 
 #ifdef _WIN32
 #include <windows.h> 
@@ -21,9 +22,20 @@
 #include <unistd.h>
 #endif
 
+struct ShmArea;
+
 struct Process {
 	std::string cmd;
 	bool running;
+	bool outputEOF; // the process closed its output, readLine won't get anything anymore
+	size_t outbufferPos; // outbuffer data before this was already returned by readLine
+	long long spawnTime; // how long run() took to start it, in microseconds
+	// The shared memory transport (see shmring.h, only on Linux): run()
+	// offers it to the bot if offerSharedMemory is set, and it is used after
+	// useSharedMemory().
+	bool offerSharedMemory, shmActive;
+	ShmArea* shm;
+	int shmWakeFd, shmBotWakeFd; // eventfds, we wait on shmWakeFd
 	int forkInputFd, forkOutputFd;
 	std::string inbuffer, outbuffer;
 
@@ -38,7 +50,8 @@ struct Process {
 #endif
 	
 	Process(const std::string& __cmd = "")
-	: cmd(__cmd), running(false),
+	: cmd(__cmd), running(false), outputEOF(false), outbufferPos(0), spawnTime(0),
+	offerSharedMemory(false), shmActive(false), shm(NULL), shmWakeFd(-1), shmBotWakeFd(-1),
 #ifdef _WIN32
 	g_hChildStd_IN_Rd(NULL),
 	g_hChildStd_IN_Wr(NULL),
@@ -49,21 +62,74 @@ struct Process {
 	forkInputFd(0), forkOutputFd(0), forkId(0) 
 #endif
 	{}
-	~Process() { destroy(); }
+	// Ends it if it still runs, waits for it (it is killed if it doesn't
+	// exit on its own quickly) and closes the pipes.
+	~Process();
 	
 	operator bool() const { return running; }
 	void destroy();
 	void waitForExit();
 	void run();
+	// Checks without blocking whether it is gone, e.g. before reusing it.
+	bool hasExited();
+	// The CPU time (user + system, in ms) it used so far and its peak memory
+	// (in kB), from /proc. Returns false where that isn't available; maxRss
+	// stays as it is if only that is missing (e.g. when it already exited).
+	bool readUsage(long& cpuTime, long& maxRss) const;
+	// Reads and writes go through the shared memory from now on, when the
+	// bot said "shm". Returns false if it wasn't offered.
+	bool useSharedMemory();
+	void closeSharedMemory();
 	
 	Process& operator<<(const std::string& s) { inbuffer += s; return *this; }
 	Process& operator<<(void (*func)(Process&)) { (*func)(*this); return *this; }
 	
+	// Reads the output in chunks and returns it line by line, without the '\n'.
+	// The first version points into outbuffer, valid until the next readLine.
+	bool readLine(const char*& line, size_t& len, size_t timeout = 0);
 	bool readLine(std::string& s, size_t timeout = 0);
+	// There is a complete line in outbuffer, i.e. readLine won't wait.
+	bool hasLine() const;
 	
+	// Sends inbuffer and then the parts with one writev, as far as the pipe
+	// takes it without blocking. The rest is kept in inbuffer for flushSome.
+	// Both return false if the process doesn't read its input anymore.
+	bool writeParts(const std::string* parts, size_t numParts);
+	bool flushSome();
+	bool hasPendingInput() const { return !inbuffer.empty(); }
+	// Blocks until inbuffer is written (or the process stopped reading).
 	void flush();
 };
 
+// Waits for output of several processes at once (with epoll on Linux,
+// poll on other systems). Processes are identified by the id given to Add,
+// e.g. their index.
+struct ProcessPoller {
+	std::vector<Process*> processes; // by id, NULL if not added
+	std::vector<char> watchingInput; // by id, whether we wait to write to it
+	std::vector<char> watchingShm; // by id, whether we wait for its eventfd
+	int epollFd;
+	std::vector<int> readyBuffer;
+	
+	ProcessPoller();
+	~ProcessPoller();
+	void Add(int id, Process* p);
+	void Remove(int id);
+	// To be called when hasPendingInput() of the process changed. When it
+	// starts to use shared memory, Add it again.
+	void Update(int id);
+	
+	// Waits until some of the processes have output (or closed it), can take
+	// their pending input or until timeout ms are over. Fills ready with their
+	// ids (maybe twice) and returns false on timeout. On Windows, all
+	// processes are always reported as ready.
+	bool Wait(std::vector<int>& ready, size_t timeout);
+	
+private:
+	ProcessPoller(const ProcessPoller&);
+	ProcessPoller& operator=(const ProcessPoller&);
+};
+
 inline void flush(Process& p) { p.flush(); }
 inline void endl(Process& p) { p << "\n"; p.flush(); }
 
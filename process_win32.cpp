@@ -145,11 +145,32 @@ void Process::destroy() {
 	running = false;
 }
 
+Process::~Process() {
+	destroy();
+	closeSharedMemory();
+}
+
 void Process::waitForExit() {
 	if (running)
 		WaitForSingleObject(hProcess, INFINITE);
 }
 
+bool Process::hasExited() {
+	return !running || WaitForSingleObject(hProcess, 0) == WAIT_OBJECT_0;
+}
+
+// Not counted on Windows.
+bool Process::readUsage(long& cpuTime, long& maxRss) const {
+	return false;
+}
+
+// There is no shared memory transport on Windows, bots never get it offered.
+bool Process::useSharedMemory() {
+	return false;
+}
+
+void Process::closeSharedMemory() {}
+
 static timeval millisecsToTimeval(size_t ms) {
 	timeval v;
 	v.tv_sec = ms / 1000;
@@ -157,37 +178,56 @@ static timeval millisecsToTimeval(size_t ms) {
 	return v;
 }
 
-bool Process::readLine(std::string& s, size_t timeout) {
-	DWORD dwRead = 0; 
-	CHAR chBuf; 
-	BOOL bSuccess = FALSE;
+bool Process::hasLine() const {
+	return memchr(outbuffer.data() + outbufferPos, '\n', outbuffer.size() - outbufferPos) != NULL;
+}
+
+// Takes the next complete line out of outbuffer, without the "\r\n".
+static bool takeLine(Process& p, const char*& line, size_t& len) {
+	const char* start = p.outbuffer.data() + p.outbufferPos;
+	const char* end = (const char*)memchr(start, '\n', p.outbuffer.size() - p.outbufferPos);
+	if(!end) return false;
+	line = start;
+	len = end - start;
+	p.outbufferPos += len + 1;
+	if(len > 0 && line[len - 1] == '\r') --len;
+	return true;
+}
+
+static const DWORD ReadChunkSize = 4096;
 
+// ReadFile on a pipe returns what is there (at least one byte), so this
+// still blocks like before, the timeout is not used.
+bool Process::readLine(const char*& line, size_t& len, size_t timeout) {
 	for (;;) 
 	{ 
-		bSuccess = ReadFile( g_hChildStd_OUT_Rd, &chBuf, 1, &dwRead, NULL);
+		if (takeLine(*this, line, len)) return true;
+		if (outputEOF) return false;
+
+		outbuffer.erase(0, outbufferPos);
+		outbufferPos = 0;
+		const size_t oldSize = outbuffer.size();
+		outbuffer.resize(oldSize + ReadChunkSize);
+		DWORD dwRead = 0; 
+		BOOL bSuccess = ReadFile( g_hChildStd_OUT_Rd, &outbuffer[oldSize], ReadChunkSize, &dwRead, NULL);
+		outbuffer.resize(oldSize + dwRead);
 		if( ! bSuccess || dwRead == 0 )
 		{
 			outbuffer = "";
+			outputEOF = true;
 			return false;
 		}
-		else
-		{
-			outbuffer += chBuf;
-		}
-
-		if (outbuffer[outbuffer.size() - 1] == '\n')
-		{
-			if (outbuffer[outbuffer.size() - 2] == '\r')
-				outbuffer.resize(outbuffer.size() - 2);
-			else
-				outbuffer.resize(outbuffer.size() - 1);
-			s = outbuffer;
-			outbuffer = "";
-			return true;
-		}
-
 	} 
 }
+
+bool Process::readLine(std::string& s, size_t timeout) {
+	const char* line;
+	size_t len;
+	if(!readLine(line, len, timeout)) return false;
+	s.assign(line, len);
+	return true;
+}
+
 void Process::flush() {
 	DWORD dwRead = inbuffer.size(), dwWritten; 
 	BOOL bSuccess = FALSE;
@@ -206,4 +246,39 @@ void Process::flush() {
 	inbuffer.resize(0);
 }
 
+// Writing blocks on Windows, like flush.
+bool Process::writeParts(const std::string* parts, size_t numParts) {
+	for(size_t i = 0; i < numParts; ++i) inbuffer += parts[i];
+	flush();
+	return true;
+}
+
+bool Process::flushSome() {
+	flush();
+	return true;
+}
+
+// There is no way to wait for anonymous pipes, so all processes are
+// reported and readLine blocks as before.
+ProcessPoller::ProcessPoller() : epollFd(-1) {}
+ProcessPoller::~ProcessPoller() {}
+
+void ProcessPoller::Add(int id, Process* p) {
+	if((size_t)id >= processes.size()) processes.resize(id + 1, NULL);
+	processes[id] = p;
+}
+
+void ProcessPoller::Remove(int id) {
+	if((size_t)id < processes.size()) processes[id] = NULL;
+}
+
+void ProcessPoller::Update(int id) {}
+
+bool ProcessPoller::Wait(std::vector<int>& ready, size_t timeout) {
+	ready.clear();
+	for(size_t id = 0; id < processes.size(); ++id)
+		if(processes[id]) ready.push_back(id);
+	return !ready.empty();
+}
+
 #endif // _WIN32
@@ -0,0 +1,143 @@
+/*
+ *  shmring.h
+ *  PlanetWars
+ *
+ *  code under GPLv3
+ *
+ */
+
+#ifndef __PW__SHMRING_H__
+#define __PW__SHMRING_H__
+
+// The shared memory transport between the engine and a bot, which it can
+// use instead of stdin/stdout (only on Linux). With -shm, the engine starts
+// the bots with PW_SHM_FDS="<memfd> <bot wakeup> <engine wakeup>" in their
+// environment. A bot which wants it says "shm" during a turn (see
+// Game::RequestSharedMemory) and from then on, everything in both directions
+// goes through the two rings of ShmArea in the memfd. The pipes stay open,
+// so that both sides see when the other one is gone.
+//
+// Each side sleeps on its own eventfd, which the other side increments when
+// it wrote something or made room in the ring while the first one waited.
+// Only then: a side which is awake looks at the ring anyway. Before going
+// to sleep, a side polls the ring for a while (ShmSpin), as a fast answer
+// comes sooner than a sleep and wakeup would take.
+
+#ifdef __linux__
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+#define PW_SHM_ENV "PW_SHM_FDS"
+
+// The fds of the memfd and of the eventfds in the bot.
+enum { ShmBotMemFd = 3, ShmBotWakeFd = 4, ShmBotEngineWakeFd = 5 };
+
+// Bytes in one direction, with one writer and one reader.
+struct ShmRing {
+	enum { Size = 64 * 1024 }; // a power of two
+	// Bytes written / read so far, wrapping around. Each is only changed by
+	// its side.
+	uint32_t head, tail;
+	// Set while that side sleeps and wants to be woken up.
+	uint32_t readerWaiting, writerWaiting;
+	char data[Size];
+
+	size_t Used() const {
+		return __atomic_load_n(&head, __ATOMIC_ACQUIRE) - __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+	}
+
+	// Copies as much of p as fits into the ring and returns how much.
+	size_t Write(const char* p, size_t len) {
+		const uint32_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+		len = std::min(len, (size_t)Size - (h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE)));
+		const size_t pos = h & (Size - 1);
+		const size_t first = std::min(len, (size_t)Size - pos);
+		memcpy(data + pos, p, first);
+		memcpy(data, p + first, len - first);
+		__atomic_store_n(&head, h + (uint32_t)len, __ATOMIC_RELEASE);
+		return len;
+	}
+
+	// Takes up to len bytes out of the ring and returns how many.
+	size_t Read(char* p, size_t len) {
+		const uint32_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+		len = std::min(len, (size_t)(__atomic_load_n(&head, __ATOMIC_ACQUIRE) - t));
+		const size_t pos = t & (Size - 1);
+		const size_t first = std::min(len, (size_t)Size - pos);
+		memcpy(p, data + pos, first);
+		memcpy(p + first, data, len - first);
+		__atomic_store_n(&tail, t + (uint32_t)len, __ATOMIC_RELEASE);
+		return len;
+	}
+
+	// Before going to sleep: set it and then check the ring once more. After
+	// Write / Read: whether the other side has to be woken up. The fences
+	// make sure that one of both sees the other one.
+	void SetReaderWaiting(bool w) {
+		__atomic_store_n(&readerWaiting, (uint32_t)w, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	void SetWriterWaiting(bool w) {
+		__atomic_store_n(&writerWaiting, (uint32_t)w, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	bool ReaderWaits() const {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		return __atomic_load_n(&readerWaiting, __ATOMIC_RELAXED) != 0;
+	}
+	bool WriterWaits() const {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		return __atomic_load_n(&writerWaiting, __ATOMIC_RELAXED) != 0;
+	}
+};
+
+struct ShmArea {
+	ShmRing toBot, toEngine;
+};
+
+// Rounds of polling before a side goes to sleep, some microseconds.
+enum { ShmSpinIterations = 500 };
+
+// With one CPU, the other side can't make progress while we spin.
+inline bool ShmSpinHelps() {
+	static const bool helps = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+	return helps;
+}
+
+inline void ShmPause() {
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+}
+
+// Polls the ring for a while. Returns true as soon as ring.Used() is not
+// used anymore, false if it still is at the end (or spinning doesn't help).
+inline bool ShmSpin(const ShmRing& ring, size_t used) {
+	if (!ShmSpinHelps()) return false;
+	for (int i = 0; i < ShmSpinIterations; ++i) {
+		if (ring.Used() != used) return true;
+		ShmPause();
+	}
+	return false;
+}
+
+// Wakes up the side which sleeps on that eventfd.
+inline void ShmWake(int eventFd) {
+	const uint64_t one = 1;
+	ssize_t r = write(eventFd, &one, sizeof(one));
+	(void)r;
+}
+
+// Resets the eventfd after waking up.
+inline void ShmClearWakeup(int eventFd) {
+	uint64_t count;
+	ssize_t r = read(eventFd, &count, sizeof(count));
+	(void)r;
+}
+
+#endif
+
+#endif